@@ -0,0 +1,24 @@
+@echo off
+setlocal
+
+IF "%2"=="" (
+  (echo Usage: nudge PID pause^|resume^|flush^|rotate)
+  GOTO:stop
+)
+
+set ARG=
+IF "%2"=="pause" set ARG=1
+IF "%2"=="resume" set ARG=2
+IF "%2"=="flush" set ARG=3
+IF "%2"=="rotate" set ARG=4
+
+IF "%ARG%"=="" (
+  (echo Unknown nudge %2)
+  GOTO:stop
+)
+
+echo %DYNAMORIO_HOME%\bin32\drconfig.exe -nudge_pid %1 0 %ARG%
+%DYNAMORIO_HOME%\bin32\drconfig.exe -nudge_pid %1 0 %ARG%
+
+:stop
+endlocal
@@ -19,6 +19,7 @@ class Grapher: public LogRunnerObserver
         block.end = last_bb.next;
         block.last = last_bb.next - last_bb.len_last;
         block.ts = last_bb.ts;
+        block.hits = 0;
         switch (last_bb.link) {
             case LINK_CALL: block.jump = block_t::CALL; break;
             case LINK_RETURN: block.jump = block_t::RET; break;
@@ -38,6 +39,7 @@ class Grapher: public LogRunnerObserver
         block.jump = block_t::RET;
         block.name = apicall_now->name;
         block.ts = apicall_now->ts;
+        block.hits = 0;
         return true;
     }
 
@@ -83,6 +85,29 @@ public:
         }
     }
 
+    void
+    OnBBRepeat(uint thread_id, df_stackitem_c &last_bb, vec_memaccess_t &memaccesses, uint count) override
+    {
+        // the history already ends with this block, once is enough
+        OnBB(thread_id, last_bb, memaccesses);
+    }
+
+    void
+    OnBlockCount(df_stackitem_c &the_bb, uint count) override
+    {
+        std::lock_guard<std::mutex> lock(g_flamegraph_mx);
+        if (! g_flamegraph.BlockExists(the_bb.pc))
+        {
+            block_t block;
+            block.thread_id = 0;
+            if (assign_block(block, the_bb))
+                g_flamegraph.AddBlock(block);
+        }
+
+        block_t *block = g_flamegraph.GetBlock(the_bb.pc);
+        if (block) block->hits += count;
+    }
+
     void
     OnApiCall(uint thread_id, df_apicall_c &apicall_ret) override
     {
@@ -179,6 +204,9 @@ public:
         std::string command = argv[0];
         if (command == "dump") {
             g_flamegraph.DumpHistory();
+        } else if (command == "regions") {
+            // the blocks run so far as ranges, for the tracer's -ranges
+            g_flamegraph.DumpRegions();
         }
     }
 };
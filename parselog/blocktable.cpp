@@ -0,0 +1,102 @@
+#include <string>
+#include <stdexcept>
+
+#define WITHOUT_DR
+#include "datatypes.h"
+
+#include "logparser.h"
+#include "blocktable.h"
+
+bool
+blocktable_c::load(const char* filename)
+{
+    logparser_c parser;
+    if (!parser.open(filename)) return false;
+
+    blocks_.clear();
+    ids_.clear();
+    refs_.clear();
+    record_sizes_.clear();
+    counts_.clear();
+    demoted_.clear();
+
+    char *item;
+    while ((item = parser.fetch()) != nullptr) {
+        if (*reinterpret_cast<uint*>(item) == KIND_COUNT) {
+            buf_block_count_t *buf_count = reinterpret_cast<buf_block_count_t*>(item);
+            if (buf_count->id >= counts_.size())
+                counts_.resize(buf_count->id + 1);
+            counts_[buf_count->id] = buf_count->count;
+            if (buf_count->flags & BLOCK_COUNT_DEMOTED)
+                demoted_.push_back(buf_count->id);
+            continue;
+        }
+
+        buf_block_t *buf_block = reinterpret_cast<buf_block_t*>(item);
+        if (buf_block->kind != KIND_BLOCK)
+            throw std::runtime_error("Expect only block descriptors in " + std::string(filename));
+
+        uint id = buf_block->id;
+        if (id >= blocks_.size()) {
+            blocks_.resize(id + 1);
+            refs_.resize(id + 1);
+            record_sizes_.resize(id + 1, sizeof(uint));
+        }
+        blocks_[id] = *buf_block;
+        ids_[(uint)buf_block->pc] = id;
+
+        // templates, the trace keeps the address of a memory ref and
+        // both counters of a loop
+        std::vector<mem_ref_t> &refs = refs_[id];
+        refs.clear();
+        record_sizes_[id] = sizeof(uint);
+        for (uint i = 0; i < blocks_[id].refs; i++) {
+            item = parser.fetch();
+            if (!item)
+                throw std::runtime_error("Truncated memory refs in " + std::string(filename));
+            refs.push_back(*reinterpret_cast<mem_ref_t*>(item));
+            record_sizes_[id] += refs.back().kind == KIND_LOOP ? 2 * sizeof(uint) : sizeof(uint);
+        }
+    }
+
+    return true;
+}
+
+uint
+blocktable_c::record_size(uint id) const
+{
+    if (id >= record_sizes_.size())
+        return sizeof(uint);
+    return record_sizes_[id];
+}
+
+const buf_block_t*
+blocktable_c::get(uint id)
+{
+    if (id >= blocks_.size() || blocks_[id].kind != KIND_BLOCK)
+        return nullptr;
+    return &blocks_[id];
+}
+
+const buf_block_t*
+blocktable_c::find(uint pc) const
+{
+    auto it = ids_.find(pc);
+    if (it == ids_.end())
+        return nullptr;
+    return &blocks_[it->second];
+}
+
+bool
+blocktable_c::get_bb(uint id, mem_ref_t &buf_bb)
+{
+    const buf_block_t *buf_block = get(id);
+    if (!buf_block) return false;
+
+    buf_bb.kind = KIND_BB;
+    buf_bb.addr = buf_block->last_pc;
+    buf_bb.size = buf_block->size;
+    buf_bb.pc = buf_block->pc;
+
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#define WITHOUT_DR
+#include "datatypes.h"
+
+// Block descriptors written by the tracer into the .blocks file,
+// used to expand compact block id records. With memtrace a descriptor
+// carries the memory ref templates of the block, the id record is then
+// followed by their addresses. In coverage mode the file also carries
+// the execution count of each block, also with -demote where it tells
+// the blocks only counted once hot. Branch traces walk the blocks by pc.
+class blocktable_c {
+private:
+    std::vector<buf_block_t> blocks_;
+    std::unordered_map<uint, uint> ids_; // pc to the latest block id
+    std::vector<std::vector<mem_ref_t>> refs_;
+    std::vector<uint> record_sizes_;
+    std::vector<uint> counts_;
+    std::vector<uint> demoted_; // ids only counted after -demote
+
+public:
+    bool load(const char* filename);
+    const buf_block_t* get(uint id);
+    const buf_block_t* find(uint pc) const;
+    bool get_bb(uint id, mem_ref_t &buf_bb);
+    const std::vector<mem_ref_t>& get_refs(uint id) { return refs_[id]; }
+    uint record_size(uint id) const;
+    uint count(uint id) { return id < counts_.size() ? counts_[id] : 0; }
+    bool has_counts() { return !counts_.empty(); }
+    const std::vector<uint>& demoted() const { return demoted_; }
+    size_t size() { return blocks_.size(); }
+};
@@ -1,12 +1,16 @@
 #include <iostream>
 #include <sstream>
+#include <cstring>
 
 #define WITHOUT_DR
 #include "datatypes.h"
 
 #include "buffer.h"
+#include "blocktable.h"
+#include "ringreader.h"
+#include "muxreader.h"
 
-buffer_c::buffer_c() {
+buffer_c::buffer_c(): blocks_(nullptr) {
     allocated_ = 16 * 8192 * 128;
     data_ = new char[allocated_];
     reset();
@@ -23,13 +27,19 @@ buffer_c::reset(uint64 inpos) {
     inpos_ = inpos;
 }
 
-uint
-buffer_c::extract(std::istream &in) {
+// Move the bytes not fetched yet to the start, pos_ is left after them
+void
+buffer_c::keep_rest() {
     if (pos_ > 0) {
         uint new_pos = available_ - pos_;
         memcpy(&data_[0], &data_[pos_], new_pos);
         pos_ = new_pos;
     }
+}
+
+uint
+buffer_c::extract(std::istream &in) {
+    keep_rest();
     in.read(&data_[pos_], allocated_ - pos_);
     uint bytes = in.gcount();
     available_ = pos_ + bytes;
@@ -38,6 +48,26 @@ buffer_c::extract(std::istream &in) {
     return bytes;
 }
 
+uint
+buffer_c::extract(ringreader_c &ring, uint thread_id) {
+    keep_rest();
+    uint bytes = ring.read(thread_id, &data_[pos_], allocated_ - pos_);
+    available_ = pos_ + bytes;
+    pos_ = 0;
+
+    return bytes;
+}
+
+uint
+buffer_c::extract(muxreader_c &mux, uint thread_id) {
+    keep_rest();
+    uint bytes = mux.read(thread_id, &data_[pos_], allocated_ - pos_);
+    available_ = pos_ + bytes;
+    pos_ = 0;
+
+    return bytes;
+}
+
 uint
 buffer_c::peek() {
     uint kind;
@@ -51,7 +81,13 @@ buffer_c::fetch() {
     uint kind;
     if (pos_ + sizeof(kind) > available_) return NULL;
     kind = *reinterpret_cast<uint*>(data());
-    uint size = buf_size(kind);
+    // zeros follow the last record of a -mmap dump cut short
+    if (kind == KIND_NONE) return NULL;
+    uint size;
+    if ((kind & KIND_BB_ID) && blocks_)
+        size = blocks_->record_size(kind & BB_ID_MASK);
+    else
+        size = buf_size(kind);
     if (size == 0) return NULL;
     if (pos_ + size > available_) return NULL;
     char *buf_item = data();
@@ -62,6 +98,9 @@ buffer_c::fetch() {
 
 uint // static
 buffer_c::buf_size(uint kind) {
+    if (kind & KIND_BB_ID)
+        return sizeof(uint);
+
     switch (kind) {
     case KIND_READ:
     case KIND_WRITE:
@@ -76,6 +115,10 @@ buffer_c::buf_size(uint kind) {
         return sizeof(buf_symbol_t);
     case KIND_STRING:
         return sizeof(buf_string_t);
+    case KIND_STRING_DEF:
+        return sizeof(buf_string_def_t);
+    case KIND_STRING_REF:
+        return sizeof(buf_string_ref_t);
     case KIND_LIB_CALL:
         return sizeof(buf_lib_call_t);
     case KIND_LIB_RET:
@@ -89,6 +132,22 @@ buffer_c::buf_size(uint kind) {
     case KIND_ARGS:
     case KIND_THREAD:
         return sizeof(buf_event_t);
+    case KIND_BLOCK:
+        return sizeof(buf_block_t);
+    case KIND_COUNT:
+        return sizeof(buf_block_count_t);
+    case KIND_REPEAT:
+        return sizeof(buf_repeat_t);
+    case KIND_TNT:
+        return sizeof(buf_tnt_t);
+    case KIND_TARGET:
+        return sizeof(buf_target_t);
+    case KIND_TIME:
+        return sizeof(buf_time_t);
+    case KIND_CHUNK:
+        return sizeof(buf_chunk_t);
+    case KIND_INDEX:
+        return sizeof(buf_index_t);
     default: {
         std::ostringstream oss;
         oss << "Unknown buffer_c::buf_size kind 0x" << std::hex << kind;
@@ -1,5 +1,9 @@
 #pragma once
 
+class blocktable_c;
+class ringreader_c;
+class muxreader_c;
+
 class buffer_c {
 private:
     char *data_;
@@ -7,12 +11,17 @@ private:
     uint allocated_;
     uint available_;
     uint64 inpos_;
+    const blocktable_c *blocks_;
+
+    void keep_rest();
 public:
     buffer_c();
     ~buffer_c();
 
     void reset(uint64 inpos = 0);
     uint extract(std::istream &in);
+    uint extract(ringreader_c &ring, uint thread_id);
+    uint extract(muxreader_c &mux, uint thread_id);
 
     char *data() {
         return &data_[pos_];
@@ -31,4 +40,6 @@ public:
 
     static uint buf_size(uint kind);
     uint64 inpos() { return inpos_; };
+    // sizes compact block id records, which carry the block addresses
+    void set_blocks(const blocktable_c *blocks) { blocks_ = blocks; }
 };
@@ -24,6 +24,7 @@ typedef struct {
     std::string name;
     uint thread_id;
     uint64_t ts;
+    uint64_t hits;
 } block_t;
 
 typedef struct {
@@ -560,7 +561,7 @@ public:
         std::ofstream outfile;
         outfile.open(csvname.c_str());
 
-        outfile << "ts,tid,pc,kind,next,jump" << std::endl;
+        outfile << "ts,tid,pc,kind,next,jump,hits" << std::endl;
         for (auto k: blocks_order_)
         {
             block_t &block = blocks_[k];
@@ -583,6 +584,7 @@ public:
                 case block_t::JMP: outfile << "JMP"; break;
                 default: outfile << "";
             }
+            outfile << "," << std::dec << block.hits;
             outfile << std::endl;
         }
     }
@@ -5,6 +5,8 @@
 #include "datatypes.h"
 
 #include "logparser.h"
+#include "ringreader.h"
+#include "muxreader.h"
 
 bool
 logparser_c::open(const char* filename)
@@ -18,13 +20,48 @@ logparser_c::open(const char* filename)
     return false;
 }
 
+bool
+logparser_c::open(ringreader_c *ring, uint thread_id, const char* name)
+{
+    if (!ring->is_open()) return false;
+
+    filename_ = name;
+    ring_ = ring;
+    thread_id_ = thread_id;
+    buffer_.reset(0);
+    return true;
+}
+
+bool
+logparser_c::open(muxreader_c *mux, uint thread_id, const char* name)
+{
+    if (!mux->is_open()) return false;
+
+    filename_ = name;
+    mux_ = mux;
+    thread_id_ = thread_id;
+    mux_->seek(thread_id, 0);
+    buffer_.reset(0);
+    return true;
+}
+
+uint
+logparser_c::extract()
+{
+    if (ring_)
+        return buffer_.extract(*ring_, thread_id_);
+    if (mux_)
+        return buffer_.extract(*mux_, thread_id_);
+    return buffer_.extract(input_);
+}
+
 char*
 logparser_c::fetch()
 {
     while (true) {
         char *item = buffer_.fetch();
         if (item) return item;
-        if (!buffer_.extract(input_)) break;
+        if (!extract()) break;
     }
     return nullptr;
 }
@@ -35,7 +72,7 @@ logparser_c::peek()
     while (true) {
         uint kind = buffer_.peek();
         if (kind != KIND_NONE) return kind;
-        if (!buffer_.extract(input_)) break;
+        if (!extract()) break;
     }
     return KIND_NONE;
 }
@@ -43,12 +80,42 @@ logparser_c::peek()
 void
 logparser_c::seek(uint64 filepos)
 {
-    if (input_) {
+    // the ring only goes forward
+    if (mux_) {
+        mux_->seek(thread_id_, filepos);
+        buffer_.reset(filepos);
+    } else if (!ring_ && input_) {
         input_.seekg(filepos);
         buffer_.reset(filepos);
     }
 }
 
+bool
+logparser_c::read_index(std::vector<buf_chunk_t> &chunks)
+{
+    buf_index_t buf_index;
+
+    chunks.clear();
+    if (ring_) return false;
+    if (mux_) return mux_->read_index(thread_id_, chunks);
+
+    // a reader of its own, the stream position is left alone
+    std::ifstream in(filename_, std::ios_base::binary);
+    in.seekg(-(std::streamoff)sizeof(buf_index_t), std::ios_base::end);
+    if (!in.read(reinterpret_cast<char*>(&buf_index), sizeof(buf_index)) ||
+        buf_index.kind != KIND_INDEX)
+        return false;
+
+    chunks.resize(buf_index.count);
+    in.seekg(buf_index.offset);
+    in.read(reinterpret_cast<char*>(chunks.data()), buf_index.count * sizeof(buf_chunk_t));
+    if (!in) {
+        chunks.clear();
+        return false;
+    }
+    return true;
+}
+
 uint64_t
 logparser_c::tell()
 {
@@ -1,20 +1,38 @@
 #pragma once
 
 #include <fstream>
+#include <vector>
 #include "buffer.h"
 
+class ringreader_c;
+class muxreader_c;
+
 class logparser_c {
 private:
     std::string filename_;
     std::ifstream input_;
     buffer_c buffer_;
+    // live trace: chunks of the thread from the ring instead of the file
+    ringreader_c *ring_;
+    // or from the dump file of all the threads
+    muxreader_c *mux_;
+    uint thread_id_;
+
+    uint extract();
 
 public:
+    logparser_c(): ring_(nullptr), mux_(nullptr), thread_id_(0) {}
+
     bool open(const char* filename);
+    bool open(ringreader_c *ring, uint thread_id, const char* name);
+    bool open(muxreader_c *mux, uint thread_id, const char* name);
     char* fetch();
     uint peek();
     void seek(uint64 filepos);
     uint64 tell();
+    void set_blocks(const blocktable_c *blocks) { buffer_.set_blocks(blocks); }
+    // chunk headers from the index closing the file, false without one
+    bool read_index(std::vector<buf_chunk_t> &chunks);
 
     std::string filename() { return filename_; };
 };
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstring>
 #include <string>
 #include <map>
 #include <vector>
@@ -20,8 +21,46 @@ LogRunner::Open(std::string &filename) {
     filename_ = filename;
     const uint main_thread_id = 0;
 
-    if (info_threads_[main_thread_id].logparser.open(filename_.c_str())) {
+    // all the threads in one file (-mux), named as the .bin would be
+    const std::string mux_ext = ".mux";
+    if (filename_.size() > mux_ext.size() &&
+        filename_.compare(filename_.size() - mux_ext.size(), mux_ext.size(), mux_ext) == 0) {
+        if (! mux_.open(filename_)) {
+            std::cout << "Fail to open .mux: " << filename_ << std::endl;
+            return false;
+        }
+        std::cout << "Mux:" << filename_ << std::endl;
+        filename_ = filename_.substr(0, filename_.size() - mux_ext.size()) + ".bin";
+    }
+
+    // The info file tells the mode, block counts mean another thing in each,
+    // and the serials tagging the chunks of each thread in a .mux
+    std::ifstream info_file(GetPrefix() + ".txt");
+    std::string line;
+    mode_.clear();
+    mux_serials_.clear();
+    while (std::getline(info_file, line)) {
+        if (line.compare(0, 5, "mode:") == 0) {
+            mode_ = line.substr(5);
+            if (!mode_.empty() && mode_.back() == '\r') mode_.pop_back();
+        } else if (line.compare(0, 4, "tid:") == 0) {
+            size_t pos = line.find(",serial:");
+            if (pos == std::string::npos || line.find(",main") != std::string::npos)
+                continue;
+            uint tid = std::stoul(line.substr(4));
+            mux_serials_[tid].push_back(std::stoul(line.substr(pos + 8)));
+        }
+    }
+    for (auto &it : mux_serials_) {
+        std::sort(it.second.begin(), it.second.end());
+    }
+
+    // Coverage runs write no dumps, only the counts of the .blocks file
+    if (mode_ == "coverage") {
+        std::cout << "Coverage:" << GetPrefix() << ".blocks" << std::endl;
+    } else if (OpenLog(info_threads_[main_thread_id], main_thread_id, filename_)) {
         std::cout << "Open:" << filename_ << std::endl;
+        info_threads_[main_thread_id].logparser.set_blocks(&blocks_);
         info_threads_[main_thread_id].running = true;
         info_threads_[main_thread_id].the_runner = this;
     } else {
@@ -30,9 +69,46 @@ LogRunner::Open(std::string &filename) {
         return false;
     }
 
+    // Compact traces keep their block descriptors aside
+    std::string blocks_name = GetPrefix() + ".blocks";
+    if (blocks_.load(blocks_name.c_str())) {
+        std::cout << "Blocks:" << blocks_name << " (" << std::dec << blocks_.size() << ")" << std::endl;
+    }
+
     return true;
 }
 
+// Live trace from the tracer's ring (-ring), to open before the .bin
+bool
+LogRunner::OpenRing(std::string &name)
+{
+    if (! ring_.open(name)) {
+        std::cout << "Fail to open ring: " << name << std::endl;
+        return false;
+    }
+    std::cout << "Ring:" << name << std::endl;
+    return true;
+}
+
+bool
+LogRunner::OpenLog(thread_info_c &thread_info, uint thread_id, const std::string &filename)
+{
+    if (ring_.is_open())
+        return thread_info.logparser.open(&ring_, thread_id, filename.c_str());
+    if (mux_.is_open()) {
+        // the next thread started with this tid, the tid itself for a run
+        // logging no serials
+        uint serial = thread_id;
+        auto it = mux_serials_.find(thread_id);
+        if (thread_id != 0 && it != mux_serials_.end() && !it->second.empty()) {
+            serial = it->second.front();
+            it->second.pop_front();
+        }
+        return thread_info.logparser.open(&mux_, serial, filename.c_str());
+    }
+    return thread_info.logparser.open(filename.c_str());
+}
+
 void
 LogRunner::FinishThread(thread_info_c &thread_info)
 {
@@ -48,45 +124,71 @@ LogRunner::FinishThread(thread_info_c &thread_info)
     thread_info.finished = true;
 }
 
+/**
+ * Steps the running thread with the earliest time record,
+ * round robin among threads stamped alike (or not stamped at all).
+ * The candidates are kept in ready_, the pending threads are only
+ * checked again by a rescan.
+ */
 bool
 LogRunner::Step(map_thread_info_t::iterator &it_thread)
 {
-    uint inactive = 0;
-    for(; inactive < info_threads_.size();
-            inactive++, it_thread++) {
-        if (it_thread == info_threads_.end()) {
-            if (request_stop_) return false;
+    if (request_stop_) return false;
 
-            it_thread = info_threads_.begin();
+    if (rescan_ || ready_.empty())
+        Rescan(it_thread);
+    if (ready_.empty())
+        return false;
+
+    uint thread_id = ready_.begin()->second;
+    ready_.erase(ready_.begin());
+
+    auto it_current = info_threads_.find(thread_id);
+    if (it_current != info_threads_.end()) {
+        thread_info_c &thread_info = it_current->second;
+
+        if (! ThreadStep(thread_info)) {
+            assert(thread_info.finished);
+            thread_stats_c &thread_stats = stats_threads_[thread_info.id];
+            thread_stats.Apply(thread_info);
+            info_threads_.erase(it_current);
+        } else if (thread_info.running) {
+            // behind the others stamped alike
+            ready_[std::make_pair(thread_info.time_ts, turns_++)] = thread_id;
         }
+    }
+    it_thread = info_threads_.upper_bound(thread_id);
+
+    return true;
+}
+
+/**
+ * Collects the running threads into ready_, round robin from it_thread,
+ * giving the pending ones a chance to go on.
+ */
+void
+LogRunner::Rescan(map_thread_info_t::iterator &it_thread)
+{
+    ready_.clear();
+    rescan_ = false;
+
+    for(uint visited = 0; visited < info_threads_.size();
+            visited++, it_thread++) {
+        if (it_thread == info_threads_.end())
+            it_thread = info_threads_.begin();
 
         thread_info_c &thread_info = it_thread->second;
 
         if (thread_info.finished)
             continue;
-        if (!thread_info.running)
+        if (!thread_info.running) {
             CheckPending(thread_info);
-        if (thread_info.running) {
-            break;
+            // its wait is over, the next one in line may be too
+            if (thread_info.running) rescan_ = true;
         }
+        if (thread_info.running)
+            ready_[std::make_pair(thread_info.time_ts, turns_++)] = it_thread->first;
     }
-
-    if (inactive == info_threads_.size()) {
-        return false;
-    }
-
-    uint thread_id = it_thread->first;
-    thread_info_c &thread_info = it_thread->second;
-    auto it_current = it_thread++;
-
-    if (! ThreadStep(thread_info)) {
-        assert(thread_info.finished);
-        thread_stats_c &thread_stats = stats_threads_[thread_info.id];
-        thread_stats.Apply(thread_info);
-        info_threads_.erase(it_current);
-    }
-
-    return true;
 }
 
 /**
@@ -104,7 +206,9 @@ LogRunner::ThreadStep(thread_info_c &thread_info)
         // Check Lib Ret first
         if (thread_info.apicall_now) {
             kind = thread_info.logparser.peek();
-            if (thread_info.last_kind == KIND_LIB_RET && kind != KIND_ARGS && kind != KIND_STRING) {
+            if (thread_info.last_kind == KIND_LIB_RET && kind != KIND_ARGS && kind != KIND_STRING &&
+                kind != KIND_STRING_DEF && kind != KIND_STRING_REF &&
+                kind != KIND_TIME && kind != KIND_CHUNK) {
                 ApiCallRet(thread_info);
                 break;
             }
@@ -112,8 +216,8 @@ LogRunner::ThreadStep(thread_info_c &thread_info)
 
         // Forward peek kind
         if (thread_info.within_bb) {
-            kind = thread_info.logparser.peek();
-            if (kind == KIND_BB || kind == KIND_LIB_CALL) {
+            kind = BranchReady(thread_info) ? KIND_BB : thread_info.logparser.peek();
+            if (kind == KIND_BB || (kind & KIND_BB_ID) || kind == KIND_LIB_CALL || kind == KIND_REPEAT) {
                 DoEndBB(thread_info);
                 break;
             }
@@ -123,6 +227,8 @@ LogRunner::ThreadStep(thread_info_c &thread_info)
         if (thread_info.pending_state == thread_info_c::PEND_AFTER_RET) {
             item = (char*)&thread_info.pending_bb;
             thread_info.pending_state = thread_info_c::PEND_NONE;
+        } else if (BranchReady(thread_info)) {
+            item = BranchNext(thread_info);
         } else {
             // Consume kind
             item = thread_info.logparser.fetch();
@@ -139,6 +245,21 @@ LogRunner::ThreadStep(thread_info_c &thread_info)
             return false;
         }
         kind = *(uint*)item;
+        const std::vector<mem_ref_t> *compact_refs = nullptr;
+        const uint *compact_addrs = nullptr;
+        if (kind & KIND_BB_ID) {
+            // Compact block id, expand to full KIND_BB
+            if (! blocks_.get_bb(kind & BB_ID_MASK, thread_info.compact_bb)) {
+                std::ostringstream oss;
+                oss << "Unknown block id " << std::dec << (kind & BB_ID_MASK);
+                throw std::runtime_error(oss.str());
+            }
+            // memory refs come as addresses right after the id
+            compact_refs = &blocks_.get_refs(kind & BB_ID_MASK);
+            compact_addrs = reinterpret_cast<uint*>(item) + 1;
+            item = (char*)&thread_info.compact_bb;
+            kind = KIND_BB;
+        }
         mem_ref_t *buf_bb;
         buf_exception_t *buf_exc;
         buf_module_t *buf_mod;
@@ -169,12 +290,35 @@ LogRunner::ThreadStep(thread_info_c &thread_info)
                 if (thread_info.apicall_now && thread_info.apicall_now->ret_addr == buf_bb->pc) {
                     thread_info.pending_bb = *buf_bb;
                     thread_info.pending_state = thread_info_c::PEND_WANT_RET;
+                    if (compact_refs)
+                        DoCompactRefs(thread_info, *compact_refs, compact_addrs);
                     continue;
                 } else {
                     DoKindBB(thread_info, *(mem_ref_t*)item);
+                    if (compact_refs)
+                        DoCompactRefs(thread_info, *compact_refs, compact_addrs);
                 }
             }
                 break;
+            case KIND_REPEAT:
+                DoKindRepeat(thread_info, *(buf_repeat_t*)item);
+                break;
+            case KIND_TNT:
+                DoKindTnt(thread_info, *(buf_tnt_t*)item);
+                break;
+            case KIND_TARGET:
+                DoKindTarget(thread_info, *(buf_target_t*)item);
+                break;
+            case KIND_TIME:
+                thread_info.time_ts = ((buf_time_t*)item)->ts;
+                break;
+            case KIND_CHUNK:
+                // the index at the end repeats the earlier headers
+                if (((buf_chunk_t*)item)->ts > thread_info.time_ts)
+                    thread_info.time_ts = ((buf_chunk_t*)item)->ts;
+                break;
+            case KIND_INDEX:
+                break;
             case KIND_LOOP:
                 buf_bb = reinterpret_cast<mem_ref_t*>(item);
                 DoMemLoop(thread_info, *buf_bb);
@@ -233,6 +377,12 @@ LogRunner::ThreadStep(thread_info_c &thread_info)
             case KIND_STRING:
                 DoKindString(thread_info, *(buf_string_t*)item);
                 break;
+            case KIND_STRING_DEF:
+                DoKindString(thread_info, *(buf_string_def_t*)item);
+                break;
+            case KIND_STRING_REF:
+                DoKindString(thread_info, *(buf_string_ref_t*)item);
+                break;
             default: {
                 std::ostringstream oss;
                 oss << "Unknown LogRunner::ThreadStep kind 0x" << std::hex << kind;
@@ -244,7 +394,10 @@ LogRunner::ThreadStep(thread_info_c &thread_info)
         } //
 
         // Last Kind
-        if (kind != KIND_ARGS && kind != KIND_STRING && kind != KIND_READ && kind != KIND_WRITE) {
+        if (kind != KIND_ARGS && kind != KIND_STRING && kind != KIND_STRING_DEF &&
+            kind != KIND_STRING_REF && kind != KIND_READ && kind != KIND_WRITE &&
+            kind != KIND_REPEAT && kind != KIND_TNT && kind != KIND_TARGET && kind != KIND_TIME &&
+            kind != KIND_CHUNK && kind != KIND_INDEX) {
             thread_info.last_kind = kind;
         }
     }
@@ -257,6 +410,7 @@ bool LogRunner::Run(RunPhase phase)
     if (phase == PHASE_NONE || phase == PHASE_PRE) {
         request_stop_ = false;
         is_multithread_ = false;
+        rescan_ = true;
 
         OnStart();
     }
@@ -279,10 +433,14 @@ bool LogRunner::RunMT()
     request_stop_ = false;
     is_multithread_ = true;
 
-    assert(info_threads_.find(main_thread_id) != info_threads_.end());
-
     OnStart();
 
+    if (mode_ == "coverage") {
+        OnFinish();
+        return true;
+    }
+    assert(info_threads_.find(main_thread_id) != info_threads_.end());
+
     for (auto &it: info_threads_) {
         assert(it.second.the_thread == nullptr);
         it.second.the_thread = std::unique_ptr<std::thread>(
@@ -377,6 +535,10 @@ LogRunner::RequestToStop()
         request_stop_ = true;
 }
 
+// Follows the calls and returns over the blocks. Only the links are used:
+// a -mode calls trace has the blocks ending in a call or return and the
+// first one after each, the jumps in between are missing and that's fine,
+// the block after a link is always the next record.
 void
 LogRunner::DoKindBB(thread_info_c &thread_info, mem_ref_t &buf_bb)
 {
@@ -499,6 +661,105 @@ LogRunner::DoKindBB(thread_info_c &thread_info, mem_ref_t &buf_bb)
     thread_info.bb_count++;
 }
 
+// The last block ran count more times in a row, a jump to itself without
+// memory refs: the stacks stay as they are
+void
+LogRunner::DoKindRepeat(thread_info_c &thread_info, buf_repeat_t &buf_repeat)
+{
+    if (thread_info.last_bb.kind != KIND_BB || thread_info.last_bb.link != LINK_JMP)
+        throw std::runtime_error("Repeat without a jump block !");
+
+    thread_info.last_bb.is_sub = false;
+    thread_info.last_bb.ts = thread_info.now_ts;
+    thread_info.bb_count += buf_repeat.count;
+
+    OnBBRepeat(thread_info.id, thread_info.last_bb, thread_info.memaccesses, buf_repeat.count);
+}
+
+// Taken bits of the conditional jumps, oldest first
+void
+LogRunner::DoKindTnt(thread_info_c &thread_info, buf_tnt_t &buf_tnt)
+{
+    if (thread_info.branch_pos < thread_info.branch_count) {
+        std::cout << std::dec << thread_info.id << "] DoKindTnt: "
+            << (thread_info.branch_count - thread_info.branch_pos) << " bits left over" << std::endl;
+    }
+    if (buf_tnt.count > TNT_BITS)
+        throw std::runtime_error("Too many taken bits !");
+
+    memcpy(thread_info.branch_bits, buf_tnt.bits, sizeof(thread_info.branch_bits));
+    thread_info.branch_count = buf_tnt.count;
+    thread_info.branch_pos = 0;
+    thread_info.branch_walk = 0;
+}
+
+// Block reached by an indirect branch, or the first one back from
+// untraced code: the walk starts over from there
+void
+LogRunner::DoKindTarget(thread_info_c &thread_info, buf_target_t &buf_target)
+{
+    if (thread_info.branch_wait || thread_info.branch_pos < thread_info.branch_count) {
+        std::cout << std::dec << thread_info.id << "] DoKindTarget: resync at 0x"
+            << std::hex << buf_target.pc << std::endl;
+    }
+    thread_info.branch_next = buf_target.pc;
+    thread_info.branch_wait = 0;
+    thread_info.branch_count = thread_info.branch_pos = 0;
+    thread_info.branch_walk = 0;
+}
+
+// A block can be rebuilt without reading further records
+bool
+LogRunner::BranchReady(thread_info_c &thread_info)
+{
+    if (thread_info.pending_state == thread_info_c::PEND_WANT_RET)
+        return false;
+    if (thread_info.branch_next)
+        return true;
+    return thread_info.branch_wait && thread_info.branch_pos < thread_info.branch_count;
+}
+
+// Next block of a branch trace as a KIND_BB record
+char*
+LogRunner::BranchNext(thread_info_c &thread_info)
+{
+    const buf_block_t *buf_block;
+
+    if (thread_info.branch_wait) {
+        buf_block = blocks_.get(thread_info.branch_wait);
+        uint pos = thread_info.branch_pos++;
+        bool taken = (thread_info.branch_bits[pos / 32] >> (pos % 32)) & 1;
+        uint len_last_instr = buf_block->size & ((1 << LINK_SHIFT_FIELD) - 1);
+        thread_info.branch_next = taken ? buf_block->target : buf_block->last_pc + len_last_instr;
+        thread_info.branch_wait = 0;
+    }
+
+    buf_block = blocks_.find(thread_info.branch_next);
+    if (! buf_block) {
+        std::ostringstream oss;
+        oss << "Unknown block at 0x" << std::hex << thread_info.branch_next;
+        throw std::runtime_error(oss.str());
+    }
+    // a cycle of direct jumps only, nothing more to learn from the trace
+    if (++thread_info.branch_walk > (1 << 16))
+        throw std::runtime_error("Endless walk over direct branches !");
+
+    switch (buf_block->branch) {
+        case BRANCH_DIRECT:
+            thread_info.branch_next = buf_block->target;
+            break;
+        case BRANCH_COND:
+            thread_info.branch_next = 0;
+            thread_info.branch_wait = buf_block->id;
+            break;
+        default:
+            thread_info.branch_next = 0;
+    }
+
+    blocks_.get_bb(buf_block->id, thread_info.branch_bb);
+    return (char*)&thread_info.branch_bb;
+}
+
 void
 LogRunner::DoKindSymbol(thread_info_c &thread_info, buf_symbol_t &buf_sym)
 {
@@ -643,6 +904,38 @@ LogRunner::DoKindString(thread_info_c &thread_info, buf_string_t &buf_str)
     const char* copyupto = std::find(buf_str.value, buf_str.value + sizeof(buf_str.value), 0);
     std::string value(buf_str.value, copyupto - buf_str.value);
 
+    AddApiString(thread_info, value);
+}
+
+// Interned: the text comes once per thread dump with its id
+void
+LogRunner::DoKindString(thread_info_c &thread_info, buf_string_def_t &buf_def)
+{
+    const char* copyupto = std::find(buf_def.value, buf_def.value + sizeof(buf_def.value), 0);
+    std::string value(buf_def.value, copyupto - buf_def.value);
+
+    thread_info.strings[buf_def.id] = value;
+    AddApiString(thread_info, value);
+}
+
+void
+LogRunner::DoKindString(thread_info_c &thread_info, buf_string_ref_t &buf_ref)
+{
+    auto it = thread_info.strings.find(buf_ref.id);
+    if (it != thread_info.strings.end()) {
+        AddApiString(thread_info, it->second);
+        return;
+    }
+
+    // the definition was before the position we started from
+    std::ostringstream oss;
+    oss << "<string #" << std::dec << buf_ref.id << ">";
+    AddApiString(thread_info, oss.str());
+}
+
+void
+LogRunner::AddApiString(thread_info_c &thread_info, const std::string &value)
+{
     df_apicall_c &libcall_now = thread_info.apicalls.back();
 
     if (thread_info.last_kind == KIND_LIB_CALL) {
@@ -684,6 +977,8 @@ LogRunner::DoKindSync(thread_info_c &thread_info, buf_event_t &buf_sync)
         if (non_suspend) {
             ss.seq = seq;
             ss.ts = thread_info.now_ts +1;
+            // a thread waiting for the next one may go on
+            rescan_ = true;
         } else {
             switch (sync_kind) {
             case SYNC_EVENT: {
@@ -776,6 +1071,21 @@ LogRunner::DoMemLoop(thread_info_c &thread_info, mem_ref_t &mem_loop)
 #endif
 }
 
+// Rebuild the memory refs of a compact block from its templates
+void
+LogRunner::DoCompactRefs(thread_info_c &thread_info, const std::vector<mem_ref_t> &refs, const uint *addrs)
+{
+    for (mem_ref_t mem_ref : refs) {
+        mem_ref.addr = *addrs++;
+        if (mem_ref.kind == KIND_LOOP) {
+            mem_ref.size = *addrs++;
+            DoMemLoop(thread_info, mem_ref);
+        } else {
+            DoMemRW(thread_info, mem_ref, mem_ref.kind == KIND_WRITE);
+        }
+    }
+}
+
 void
 LogRunner::DoKindWndProc(thread_info_c &thread_info, buf_event_t &buf_wndproc)
 {
@@ -952,13 +1262,15 @@ LogRunner::OnCreateThread(df_apicall_c &apicall, uint64 ts)
 
         thread_info_c &thread_info = info_threads_[new_thread_id];
 
+        rescan_ = true;
         thread_info.now_ts = ts;
         thread_info.the_runner = this;
 
-        if (! thread_info.logparser.open(oss.str().c_str())) {
+        if (! OpenLog(thread_info, new_thread_id, oss.str())) {
             std::cout << "Fail to open .bin: " << oss.str() << std::endl;
             thread_info.finished = true;
         } else {
+            thread_info.logparser.set_blocks(&blocks_);
             thread_info.running = new_suspended ? false : true;
 
             if (thread_info.running) {
@@ -996,6 +1308,7 @@ LogRunner::OnResumeThread(df_apicall_c &apicall, uint64 ts)
 
             info_threads_[resume_thread_id].now_ts = ts;
             info_threads_[resume_thread_id].running = true;
+            rescan_ = true;
         }
         resume_cv_.notify_all();
 
@@ -1003,6 +1316,44 @@ LogRunner::OnResumeThread(df_apicall_c &apicall, uint64 ts)
         std::cout << "thread resuming (" << ts << ")" << std::endl;
     }
 }
+void
+LogRunner::ListChunks()
+{
+    for (auto &it : info_threads_) {
+        thread_info_c &thread_info = it.second;
+        std::vector<buf_chunk_t> chunks;
+
+        std::cout << std::dec << it.first << "] ";
+        if (! thread_info.logparser.read_index(chunks)) {
+            std::cout << "no chunk index" << std::endl;
+            continue;
+        }
+        std::cout << chunks.size() << " chunks" << std::endl;
+        for (auto &chunk : chunks) {
+            std::cout << "  #" << std::dec << chunk.seq
+                << " @" << chunk.offset
+                << " size:" << chunk.size
+                << " ts:" << chunk.ts
+                << " pc:0x" << std::hex << chunk.first_pc << std::endl;
+        }
+    }
+}
+
+void
+LogRunner::ListDemoted()
+{
+    const std::vector<uint> &demoted = blocks_.demoted();
+
+    std::cout << std::dec << demoted.size() << " blocks demoted" << std::endl;
+    for (uint id : demoted) {
+        const buf_block_t *block = blocks_.get(id);
+        if (!block) continue;
+        std::cout << "  0x" << std::hex << (uint)block->pc
+            << " #" << std::dec << id
+            << " count:" << blocks_.count(id) << std::endl;
+    }
+}
+
 void
 LogRunner::Summary()
 {
@@ -1171,6 +1522,7 @@ LogRunner::RestoreState(std::istream &in)
             thread_info.logparser.open(oss.str().c_str());
         }
 
+        thread_info.logparser.set_blocks(&blocks_);
         thread_info.RestoreState(in);
         thread_info.logparser.seek(thread_info.filepos);
         thread_info.the_runner = this;
@@ -1243,6 +1595,8 @@ thread_info_c::SaveState(std::ostream &out)
 
     write_u64(out, now_ts);
 
+    write_u64(out, time_ts);
+
     write_u32(out, apicalls.size());
 
     int j = -1;
@@ -1270,6 +1624,13 @@ thread_info_c::SaveState(std::ostream &out)
         write_data(out, (char*)&pending_bb, 16);
     }
 
+    // branch walk
+    write_u32(out, branch_next);
+    write_u32(out, branch_wait);
+    write_u32(out, branch_count);
+    write_u32(out, branch_pos);
+    write_data(out, (char*)branch_bits, sizeof(branch_bits));
+
     last_bb.SaveState(out);
 
     // memaccesses
@@ -1279,6 +1640,14 @@ thread_info_c::SaveState(std::ostream &out)
         df_memaccess_c &memaccess_cur = memaccesses[i];
         memaccess_cur.SaveState(out);
     }
+
+    // interned strings
+    write_u32(out, strings.size());
+
+    for (auto &it : strings) {
+        write_u32(out, it.first);
+        write_str(out, it.second);
+    }
 }
 
 void
@@ -1302,6 +1671,7 @@ thread_info_c::RestoreState(std::istream &in)
     within_bb = (app_pc)read_u32(in);
     bb_count = read_u32(in);
     now_ts = read_u64(in);
+    time_ts = read_u64(in);
 
     apicalls.clear();
 
@@ -1331,6 +1701,14 @@ thread_info_c::RestoreState(std::istream &in)
         read_data(in, (char*)&pending_bb, 16);
     }
 
+    // branch walk
+    branch_next = read_u32(in);
+    branch_wait = read_u32(in);
+    branch_count = read_u32(in);
+    branch_pos = read_u32(in);
+    read_data(in, (char*)branch_bits, sizeof(branch_bits));
+    branch_walk = 0;
+
     last_bb.RestoreState(in);
 
     // memaccesses
@@ -1342,6 +1720,15 @@ thread_info_c::RestoreState(std::istream &in)
         df_memaccess_c *memaccess_cur = &memaccesses.back();
         memaccess_cur->RestoreState(in);
     }
+
+    // interned strings
+    strings.clear();
+
+    for(int i = read_u32(in);   // strings size
+        i; i--) {
+        uint string_id = read_u32(in);
+        strings[string_id] = read_str(in);
+    }
 }
 
 void
@@ -1371,6 +1758,7 @@ thread_info_c::Dump(int indent)
     std::cout << _tab <<  "within_bb: 0x" << std::hex << within_bb << std::endl;
     std::cout << _tab <<  "bb_count: " << std::dec << bb_count << std::endl;
     std::cout << _tab <<  "now_ts: " << now_ts << std::endl;
+    std::cout << _tab <<  "time_ts: " << time_ts << std::endl;
 
     int j = -1;
     for (uint i = 0; i < apicalls.size(); ++i) {
@@ -1668,6 +2056,13 @@ LogRunner::OnBB(uint thread_id, df_stackitem_c &last_bb, vec_memaccess_t &memacc
         observer->OnBB(thread_id, last_bb, memaccesses);
 }
 
+void
+LogRunner::OnBBRepeat(uint thread_id, df_stackitem_c &last_bb, vec_memaccess_t &memaccesses, uint count)
+{
+    for (auto &observer : observers_)
+        observer->OnBBRepeat(thread_id, last_bb, memaccesses, count);
+}
+
 void
 LogRunner::OnApiCall(uint thread_id, df_apicall_c &apicall_ret)
 {
@@ -1687,6 +2082,31 @@ LogRunner::OnStart()
 {
     for (auto &observer : observers_)
         observer->OnStart();
+
+    // Coverage run: no per-block stream, hand over the counts instead. A
+    // -demote trace run has counts too but its stream carries the blocks
+    // not demoted, they are left to it. Without the info file only
+    // coverage runs used to write counts.
+    if (!blocks_.has_counts()) return;
+    if (!mode_.empty() && mode_ != "coverage") return;
+
+    for (uint id = 1; id < blocks_.size(); id++) {
+        uint count = blocks_.count(id);
+        mem_ref_t buf_bb;
+        if (count == 0 || !blocks_.get_bb(id, buf_bb)) continue;
+
+        df_stackitem_c the_bb;
+        uint len_last_instr = buf_bb.size & ((1 << LINK_SHIFT_FIELD) - 1);
+        the_bb.kind = KIND_BB;
+        the_bb.pc = (uint) buf_bb.pc;
+        the_bb.next = (uint) buf_bb.addr + len_last_instr;
+        the_bb.link = buf_bb.size >> LINK_SHIFT_FIELD;
+        the_bb.len_last = len_last_instr;
+        the_bb.is_sub = false;
+
+        for (auto &observer : observers_)
+            observer->OnBlockCount(the_bb, count);
+    }
 }
 
 void
@@ -4,11 +4,15 @@
 #include <condition_variable>
 #include <sstream>
 #include <queue>
+#include <deque>
 
 #define WITHOUT_DR
 #include "datatypes.h"
 
 #include "logparser.h"
+#include "blocktable.h"
+#include "ringreader.h"
+#include "muxreader.h"
 #include "threadinfo.hpp"
 #include "observer.hpp"
 
@@ -70,6 +74,16 @@ private:
     std::condition_variable message_cv_;
     std::queue<runner_message_t> messages_;
     std::vector<LogRunnerObserver*> observers_;
+    blocktable_c blocks_;
+    ringreader_c ring_;
+    muxreader_c mux_;
+    // -mode of the run from the "mode:" line of the info file, empty if none
+    std::string mode_;
+    // -mux: serials of the threads by tid from the "tid:" lines, in the order
+    // they started, a tid Windows reused has several
+    std::map<uint, std::deque<uint>> mux_serials_;
+
+    bool OpenLog(thread_info_c &thread_info, uint thread_id, const std::string &filename);
 
 protected:
     map_thread_info_t info_threads_;
@@ -81,21 +95,39 @@ protected:
 
     bool request_stop_;
     bool is_multithread_;
+    // running threads by (time_ts, turn), the earliest first and the ones
+    // stamped alike in turn; rebuilt by Rescan once threads may have started
+    // or gone on from a wait
+    std::map<std::pair<uint64, uint64>, uint> ready_;
+    uint64 turns_ = 0;
+    bool rescan_ = true;
+
+    void Rescan(map_thread_info_t::iterator &it_thread);
 
     void DoKindBB(thread_info_c &thread_info, mem_ref_t &buf_bb);
+    void DoKindRepeat(thread_info_c &thread_info, buf_repeat_t &buf_repeat);
+    void DoKindTnt(thread_info_c &thread_info, buf_tnt_t &buf_tnt);
+    void DoKindTarget(thread_info_c &thread_info, buf_target_t &buf_target);
+    bool BranchReady(thread_info_c &thread_info);
+    char* BranchNext(thread_info_c &thread_info);
     void DoEndBB(thread_info_c &thread_info /* , bb mem read/write */);
     void DoKindSymbol(thread_info_c &thread_info, buf_symbol_t &buf_sym);
     void DoKindLibCall(thread_info_c &thread_info, buf_lib_call_t &buf_libcall);
     void DoKindLibRet(thread_info_c &thread_info, buf_lib_ret_t &buf_libret);
     void DoKindArgs(thread_info_c &thread_info, buf_event_t &buf_args);
     void DoKindString(thread_info_c &thread_info, buf_string_t &buf_str);
+    void DoKindString(thread_info_c &thread_info, buf_string_def_t &buf_def);
+    void DoKindString(thread_info_c &thread_info, buf_string_ref_t &buf_ref);
+    void AddApiString(thread_info_c &thread_info, const std::string &value);
     void DoKindSync(thread_info_c &thread_info, buf_event_t &buf_sync);
     void DoKindWndProc(thread_info_c &thread_info, buf_event_t &buf_wndproc);
     void DoMemRW(thread_info_c &thread_info, mem_ref_t &mem_rw, bool is_write);
     void DoMemLoop(thread_info_c &thread_info, mem_ref_t &mem_loop);
+    void DoCompactRefs(thread_info_c &thread_info, const std::vector<mem_ref_t> &refs, const uint *addrs);
     void OnApiCall(uint thread_id, df_apicall_c &apicall_ret);
     void OnApiUntracked(uint thread_id, df_stackitem_c &bb_untracked_api);
     void OnBB(uint thread_id, df_stackitem_c &last_bb, vec_memaccess_t &memaccesses);
+    void OnBBRepeat(uint thread_id, df_stackitem_c &last_bb, vec_memaccess_t &memaccesses, uint count);
     void OnThread(uint thread_id, uint handle_id, uint sp);
     void OnPush(uint thread_id, df_stackitem_c &the_bb, df_apicall_c *apicall_now = nullptr);
     void OnPop(uint thread_id, df_stackitem_c &the_bb);
@@ -120,6 +152,7 @@ public:
     void AddObserver(LogRunnerObserver *observer);
     void ListObservers();
     bool Open(std::string &filename);
+    bool OpenRing(std::string &name);
     void SetExecutable(std::string exename);
     void FinishThread(thread_info_c &thread_info);
 
@@ -152,6 +185,8 @@ public:
     void OnResumeThread(df_apicall_c &apicall, uint64 ts);
 
     void Summary();
+    void ListChunks();
+    void ListDemoted();
 
     void FilterApiCall(std::string &name)
     {
@@ -79,6 +79,7 @@ class Options {
 public:
     std::string filename;
     std::string exename;
+    std::string ringname;
 
     uint opt_memtrack = 0;
     bool opt_input_state = false;
@@ -105,6 +106,9 @@ public:
 
         cmdl("-z") >> exename;
 
+        if (cmdl("-r") >> ringname)
+            std::cout << "Live ring:" << ringname << std::endl;
+
         std::string procnames;
         if (cmdl("-p") >> procnames) {
             split_string(procnames, opt_procnames);
@@ -226,7 +230,7 @@ main(int argc, PCHAR* argv)
 
 	// words to be completed
 	std::vector<std::string> suggests {
-		"run", "quit", "exit", "save", "load", "history", "clear", "help"
+		"run", "quit", "exit", "save", "load", "chunks", "demoted", "history", "clear", "help"
     };
 
     Replxx rx;
@@ -236,6 +240,8 @@ main(int argc, PCHAR* argv)
 
     assert(sizeof(mem_ref_t) == 16);
     assert(sizeof(buf_string_t) == 6*16);
+    assert(sizeof(buf_string_def_t) == 6*16);
+    assert(sizeof(buf_string_ref_t) == 16);
 
     if (! g_options.process(argc, argv)) {
         AutoPause auto_pause;
@@ -263,6 +269,11 @@ main(int argc, PCHAR* argv)
     g_runner = LogRunner::instance();
     g_runner->ListObservers();
 
+    if (! g_options.ringname.empty() && ! g_runner->OpenRing(g_options.ringname)) {
+        AutoPause auto_pause;
+        return 1;
+    }
+
     if (! g_runner->Open(g_options.filename)) {
         AutoPause auto_pause;
         return 1;
@@ -336,6 +347,14 @@ main(int argc, PCHAR* argv)
         } else if (args[0] == "load") {
             load();
 
+			rx.history_add(input);
+        } else if (args[0] == "chunks") {
+            g_runner->ListChunks();
+
+			rx.history_add(input);
+        } else if (args[0] == "demoted") {
+            g_runner->ListDemoted();
+
 			rx.history_add(input);
 		} else if (args[0] == "history") {
 			// display the current history
@@ -357,6 +376,8 @@ main(int argc, PCHAR* argv)
             std::cout << "clear     Clear screen" << std::endl;
             std::cout << "history   List command history" << std::endl;
             std::cout << "load      Load state" << std::endl;
+            std::cout << "chunks    List the chunk index of the threads" << std::endl;
+            std::cout << "demoted   List the blocks only counted once hot" << std::endl;
             std::cout << "run       Run parse log" << std::endl;
             std::cout << "save      Save state" << std::endl;
             std::cout << "quit      Quit" << std::endl;
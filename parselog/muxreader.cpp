@@ -0,0 +1,149 @@
+#include <iostream>
+#include <algorithm>
+
+#include "muxreader.h"
+
+bool
+muxreader_c::open(const std::string &filename)
+{
+    close();
+    in_.open(filename, std::ios_base::binary);
+    if (!in_) return false;
+
+    if (!load_index()) {
+        std::cout << "Mux: no index, walking the chunks" << std::endl;
+        scan();
+    }
+
+    // listed as they were reserved, seq keeps the buffers of a thread in order
+    for (auto &it : chunks_) {
+        std::sort(it.second.begin(), it.second.end(),
+            [](const mux_chunk_t &a, const mux_chunk_t &b) { return a.seq < b.seq; });
+    }
+    return true;
+}
+
+void
+muxreader_c::close()
+{
+    if (in_.is_open()) in_.close();
+    in_.clear();
+    chunks_.clear();
+    cursors_.clear();
+}
+
+bool
+muxreader_c::load_index()
+{
+    buf_index_t buf_index;
+
+    in_.seekg(-(std::streamoff)sizeof(buf_index_t), std::ios_base::end);
+    if (!in_.read(reinterpret_cast<char*>(&buf_index), sizeof(buf_index)) ||
+        buf_index.kind != KIND_INDEX) {
+        in_.clear();
+        return false;
+    }
+
+    std::vector<mux_chunk_t> index(buf_index.count);
+    in_.seekg(buf_index.offset);
+    in_.read(reinterpret_cast<char*>(index.data()), buf_index.count * sizeof(mux_chunk_t));
+    if (!in_) {
+        in_.clear();
+        return false;
+    }
+
+    for (auto &chunk : index) {
+        chunks_[chunk.serial].push_back(chunk);
+    }
+    return true;
+}
+
+// Without the index, from the first header on as far as they are complete
+void
+muxreader_c::scan()
+{
+    mux_chunk_t chunk;
+    uint64 pos = 0;
+
+    in_.seekg(0, std::ios_base::end);
+    uint64 size = in_.tellg();
+
+    while (pos + sizeof(chunk) <= size) {
+        in_.seekg(pos);
+        if (!in_.read(reinterpret_cast<char*>(&chunk), sizeof(chunk)) ||
+            chunk.kind != KIND_MUX || chunk.offset != pos)
+            break;
+        if (pos + sizeof(chunk) + chunk.count > size)
+            break;
+        chunks_[chunk.serial].push_back(chunk);
+        pos += sizeof(chunk) + chunk.count;
+    }
+    in_.clear();
+}
+
+uint
+muxreader_c::read(uint serial, char *dst, uint max)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<mux_chunk_t> &chunks = chunks_[serial];
+    cursor_t &cursor = cursors_[serial];
+    uint bytes = 0;
+
+    while (bytes < max && cursor.chunk < chunks.size()) {
+        const mux_chunk_t &chunk = chunks[cursor.chunk];
+        uint count = std::min(chunk.count - cursor.pos, max - bytes);
+
+        in_.seekg(chunk.offset + sizeof(mux_chunk_t) + cursor.pos);
+        in_.read(dst + bytes, count);
+        count = (uint)in_.gcount();
+        in_.clear();
+        if (count == 0) break;
+
+        bytes += count;
+        cursor.pos += count;
+        if (cursor.pos == chunk.count) {
+            cursor.chunk++;
+            cursor.pos = 0;
+        }
+    }
+
+    return bytes;
+}
+
+void
+muxreader_c::seek(uint serial, uint64 pos)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    std::vector<mux_chunk_t> &chunks = chunks_[serial];
+    cursor_t &cursor = cursors_[serial];
+
+    // whole chunks are skipped by their size
+    for (cursor.chunk = 0; cursor.chunk < chunks.size(); cursor.chunk++) {
+        if (pos < chunks[cursor.chunk].count) break;
+        pos -= chunks[cursor.chunk].count;
+    }
+    cursor.pos = cursor.chunk < chunks.size() ? (uint)pos : 0;
+}
+
+bool
+muxreader_c::read_index(uint serial, std::vector<buf_chunk_t> &headers)
+{
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = chunks_.find(serial);
+
+    headers.clear();
+    if (it == chunks_.end()) return false;
+
+    // every buffer starts with its header
+    for (auto &chunk : it->second) {
+        buf_chunk_t header;
+        in_.seekg(chunk.offset + sizeof(mux_chunk_t));
+        if (!in_.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.kind != KIND_CHUNK) {
+            in_.clear();
+            continue;
+        }
+        headers.push_back(header);
+    }
+    return !headers.empty();
+}
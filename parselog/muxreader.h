@@ -0,0 +1,40 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#define WITHOUT_DR
+#include "datatypes.h"
+
+// Dump file shared by all the threads (-mux). The chunks of a thread come
+// from the index closing the file, or from walking the headers when the
+// tracer did not get to write it. Each thread log then reads its chunks
+// as one stream, positions are in that stream.
+class muxreader_c {
+private:
+    struct cursor_t {
+        size_t chunk;
+        uint pos;
+    };
+
+    std::ifstream in_;
+    std::mutex mu_;
+    std::map<uint, std::vector<mux_chunk_t>> chunks_;
+    std::map<uint, cursor_t> cursors_;
+
+    bool load_index();
+    void scan();
+
+public:
+    bool open(const std::string &filename);
+    void close();
+    bool is_open() { return in_.is_open(); }
+    // 0 once the chunks of the thread are all read
+    uint read(uint serial, char *dst, uint max);
+    void seek(uint serial, uint64 pos);
+    // headers of the thread buffers, as in the index of a thread dump
+    bool read_index(uint serial, std::vector<buf_chunk_t> &chunks);
+};
@@ -0,0 +1,120 @@
+#ifdef _WIN32
+  #include <windows.h>
+#endif
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+
+#include "ringreader.h"
+
+bool
+ringreader_c::open(const std::string &name)
+{
+#ifdef _WIN32
+    mapping_ = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+    if (!mapping_) return false;
+
+    header_ = reinterpret_cast<ring_header_t*>(
+        MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (!header_ || header_->magic != RING_MAGIC) {
+        close();
+        return false;
+    }
+    data_ = reinterpret_cast<const char*>(header_ + 1);
+    return true;
+#else
+    std::cout << "Ring is only available on Windows: " << name << std::endl;
+    return false;
+#endif
+}
+
+void
+ringreader_c::close()
+{
+    if (header_ && (header_->dropped || header_->spilled)) {
+        std::cout << "Ring: " << std::dec << header_->dropped << " buffers dropped, "
+            << header_->spilled << " spilled" << std::endl;
+    }
+#ifdef _WIN32
+    if (header_) UnmapViewOfFile(header_);
+    if (mapping_) CloseHandle(mapping_);
+#endif
+    header_ = nullptr;
+    mapping_ = nullptr;
+    data_ = nullptr;
+}
+
+void
+ringreader_c::copy_out(uint pos, void *dst, uint count)
+{
+    uint off = pos & (header_->size - 1);
+    uint first = header_->size - off;
+
+    if (first > count) first = count;
+    memcpy(dst, &data_[off], first);
+    if (count > first)
+        memcpy(reinterpret_cast<char*>(dst) + first, data_, count - first);
+}
+
+// Moves the published chunks into the thread queues, caller holds mu_.
+// Returns false if there was none.
+bool
+ringreader_c::drain()
+{
+    uint head = header_->head;
+    uint tail = header_->tail;
+    if (head == tail) return false;
+
+    // chunk contents are complete once head is seen
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    while (tail != head) {
+        ring_chunk_t chunk;
+        copy_out(tail, &chunk, sizeof(chunk));
+
+        if (chunk.count) {
+            std::string &queue = pending_[chunk.thread_id];
+            size_t at = queue.size();
+            queue.resize(at + chunk.count);
+            copy_out(tail + sizeof(chunk), &queue[at], chunk.count);
+        } else {
+            ended_.insert(chunk.thread_id);
+        }
+
+        tail += sizeof(chunk) + ((chunk.count + RING_ALIGN - 1) & ~(RING_ALIGN - 1));
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->tail = tail;
+    return true;
+}
+
+uint
+ringreader_c::read(uint thread_id, char *dst, uint max)
+{
+    std::unique_lock<std::mutex> lk(mu_);
+
+    while (header_) {
+        std::string &queue = pending_[thread_id];
+        if (! queue.empty()) {
+            uint bytes = queue.size() < max ? (uint)queue.size() : max;
+            memcpy(dst, queue.data(), bytes);
+            queue.erase(0, bytes);
+            return bytes;
+        }
+        if (ended_.count(thread_id)) break;
+
+        if (! drain()) {
+            // the tracer is gone and all it wrote is in
+            if (header_->closed && header_->head == header_->tail) break;
+            lk.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            lk.lock();
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+
+#define WITHOUT_DR
+#include "datatypes.h"
+
+// Consumer side of the shared memory ring the tracer streams its buffers
+// into (-ring). Chunks of every thread come mixed, they are sorted into a
+// queue per thread as the thread logs ask for data.
+class ringreader_c {
+private:
+    void *mapping_;
+    ring_header_t *header_;
+    const char *data_;
+    std::mutex mu_;
+    std::map<uint, std::string> pending_;
+    std::set<uint> ended_;
+
+    void copy_out(uint pos, void *dst, uint count);
+    bool drain();
+
+public:
+    ringreader_c(): mapping_(nullptr), header_(nullptr), data_(nullptr) {}
+    ~ringreader_c() { close(); }
+
+    bool open(const std::string &name);
+    void close();
+    bool is_open() { return header_ != nullptr; }
+    // blocks until the thread has data, 0 once it has exited
+    uint read(uint thread_id, char *dst, uint max);
+};
@@ -89,7 +89,17 @@ public:
     df_stackitem_c last_bb;
     df_apicall_c *apicall_now;
     mem_ref_t pending_bb;
+    mem_ref_t compact_bb;
     pending_state_e pending_state;
+    // branch trace: next block from the descriptors, 0 for a target record,
+    // the conditional block waiting for its taken bit and the bits at hand
+    app_pc branch_next;
+    uint branch_wait;
+    uint branch_bits[TNT_BITS / 32];
+    uint branch_count;
+    uint branch_pos;
+    uint branch_walk;
+    mem_ref_t branch_bb;
     uint hevent_wait;
     uint hevent_seq;
     uint hmutex_wait;
@@ -101,9 +111,13 @@ public:
     uint id;
     uint bb_count;
     uint64 now_ts;
+    // time stamp counter of the last time record, orders the threads
+    uint64 time_ts;
     std::unique_ptr<std::thread> the_thread;
     LogRunner* the_runner;
     vec_memaccess_t memaccesses;
+    // interned strings by id, as defined in this thread dump
+    std::map<uint, std::string> strings;
 
     thread_info_c():
         running(false),
@@ -113,12 +127,19 @@ public:
         critsec_wait(0),
         apicall_now(nullptr),
         pending_state(PEND_NONE),
+        branch_next(0),
+        branch_wait(0),
+        branch_bits(),
+        branch_count(0),
+        branch_pos(0),
+        branch_walk(0),
         filepos(0),
         within_bb(0),
         id(0),
         bb_count(0),
         last_kind(KIND_NONE),
         now_ts(0),
+        time_ts(0),
         the_thread(nullptr),
         the_runner(nullptr)
         {}
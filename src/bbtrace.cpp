@@ -11,12 +11,183 @@ static droption_t<bool> enable_memtrace(
     "Enable memory access trace",
     "Record all memory read/write access, looping counter and stops");
 
+static droption_t<unsigned int> num_buffers(
+    DROPTION_SCOPE_CLIENT, "buffers", 2,
+    "Number of trace buffers per thread",
+    "Filled buffers are handed to a background writer thread while the "
+    "application continues on the next one. Use 0 or 1 to write synchronously.");
+
+static droption_t<unsigned int> buf_size(
+    DROPTION_SCOPE_CLIENT, "buf_size", 256,
+    "KB of a trace buffer at thread start",
+    "Size of each trace buffer of a new thread, at least 64. Keep it small "
+    "for applications running many short-lived threads.");
+
+static droption_t<unsigned int> buf_max(
+    DROPTION_SCOPE_CLIENT, "buf_max", 4096,
+    "KB a trace buffer may grow to",
+    "A thread filling 4 buffers within about a second gets buffers twice "
+    "larger, up to this size. The flushes and the size reached per thread are written to "
+    "the info file.");
+
+static droption_t<bool> large_pages(
+    DROPTION_SCOPE_CLIENT, "large_pages", false,
+    "Trace buffers on large pages",
+    "Allocate the trace buffers as raw memory on large pages, rounded up to "
+    "the large page size. Needs the Lock pages in memory privilege already "
+    "enabled in the token of the application, otherwise plain raw memory is "
+    "used.");
+
+static droption_t<bool> enable_mmap(
+    DROPTION_SCOPE_CLIENT, "mmap", false,
+    "Trace buffers mapped from the dump files",
+    "Each thread records straight into a window of its memory mapped dump "
+    "file, a full buffer only moves the window on. The records are in the "
+    "file even when the application crashes or is killed. Uses a single "
+    "buffer per thread, not available with -ring.");
+
+static droption_t<bool> enable_mux(
+    DROPTION_SCOPE_CLIENT, "mux", false,
+    "One dump file for all the threads",
+    "Every flushed buffer goes as a chunk tagged with its thread into a "
+    "single .mux file instead of a .bin file per thread, for applications "
+    "running many threads. parselog opens the .mux file in place of the "
+    ".bin. Not used with -ring.");
+
+static droption_t<unsigned int> ring_size(
+    DROPTION_SCOPE_CLIENT, "ring", 0,
+    "MB of a shared memory ring streaming the trace",
+    "Filled buffers are copied into a ring in the named file mapping "
+    "Local\\bbtrace.<pid> instead of the dump files, for parselog -r to "
+    "analyse while the application runs. 0 writes the dump files.");
+
+static droption_t<std::string> ring_full(
+    DROPTION_SCOPE_CLIENT, "ring_full", "block",
+    "When the ring is full: block, drop or spill",
+    "block waits for the consumer to make room. drop loses the buffer and "
+    "counts it. spill writes the buffer to the dump file of the thread.");
+
+static droption_t<unsigned int> start_offset(
+    DROPTION_SCOPE_CLIENT, "start_pc", 0,
+    "Start recording at this exe offset",
+    "Blocks run uninstrumented until the instruction at this offset from the "
+    "exe base is reached, the code cache is then flushed to instrument them.");
+
+static droption_t<unsigned int> stop_offset(
+    DROPTION_SCOPE_CLIENT, "stop_pc", 0,
+    "Stop recording at this exe offset",
+    "Once recording, reaching the instruction at this offset from the exe "
+    "base flushes the code cache and blocks run uninstrumented again.");
+
+static droption_t<std::string> start_call(
+    DROPTION_SCOPE_CLIENT, "start_call", "",
+    "Start recording at a call of this export",
+    "Exported function as module!name, or name alone for any module. "
+    "Recording starts when it has been called -start_calls times.");
+
+static droption_t<unsigned int> start_calls(
+    DROPTION_SCOPE_CLIENT, "start_calls", 1,
+    "Calls of -start_call before recording",
+    "Number of calls of the -start_call export that starts recording.");
+
+static droption_t<unsigned int> start_blocks(
+    DROPTION_SCOPE_CLIENT, "start_blocks", 0,
+    "Start recording after this many blocks",
+    "Blocks of the exe and dynamic code to run before recording starts, "
+    "counted inline while waiting.");
+
+static droption_t<std::string> ranges(
+    DROPTION_SCOPE_CLIENT, "ranges", "",
+    "Only instrument blocks inside these ranges",
+    "Comma separated start-end address ranges, as 0x401000-0x401200. Blocks "
+    "of the exe or dynamic code starting elsewhere run uninstrumented.");
+
+static droption_t<std::string> ranges_file(
+    DROPTION_SCOPE_CLIENT, "ranges_file", "",
+    "Read -ranges from this file",
+    "File with the ranges, the --selected-range line printed by the regions "
+    "command of grapher after a run can be saved there as is.");
+
+static droption_t<bool> enable_compact(
+    DROPTION_SCOPE_CLIENT, "compact", false,
+    "Compact block trace encoding",
+    "Each block descriptor is written once to the .blocks file and every "
+    "execution only records a 4-byte block id.");
+
+static droption_t<unsigned int> demote(
+    DROPTION_SCOPE_CLIENT, "demote", 0,
+    "Executions after which a block is only counted",
+    "In trace mode a block ending in a jump that ran this many times is "
+    "built again with an inline counter instead of its records, calls and "
+    "returns stay traced. The final counts and which blocks were demoted "
+    "go to the .blocks file. 0 traces every execution.");
+
+static droption_t<std::string> trace_mode(
+    DROPTION_SCOPE_CLIENT, "mode", "trace",
+    "Instrumentation mode: trace, coverage, branch or calls",
+    "trace records every executed block to the per-thread dumps. "
+    "coverage only increments an inline counter per block, the counts are "
+    "written with the block descriptors to the .blocks file at exit; it has "
+    "no dump files and only wraps the calls adding or removing dynamic code. "
+    "branch only records conditional branch outcomes and indirect targets, "
+    "parselog walks the block descriptors of the .blocks file in between. "
+    "calls only records the blocks ending in a call or return and the first "
+    "block after each of them, enough for the call graph.");
+
+static droption_t<unsigned int> time_interval(
+    DROPTION_SCOPE_CLIENT, "time", 64,
+    "KB of trace between two time records",
+    "Each thread dump stamps its start, every buffer flush and every this "
+    "many KB of trace with the time stamp counter, parselog orders the "
+    "threads by them. Use 0 to only stamp the flushes.");
+
+static droption_t<std::string> api_spec(
+    DROPTION_SCOPE_CLIENT, "api_spec", "",
+    "File of the APIs to wrap and what to record of them",
+    "One API per line: [module!]name [args:N] [str:I,J,..] [noret]. Only "
+    "the listed exports of the traced modules are wrapped, recording N args "
+    "(arg 0 in the call record), the given args as strings and, unless "
+    "noret, a return record. An API the built-in table hooks keeps its "
+    "hooks with the args and return they need. Lines starting with # are "
+    "comments.");
+
+static droption_t<unsigned int> stats_interval(
+    DROPTION_SCOPE_CLIENT, "stats", 0,
+    "Seconds between two dumps of the tracer overhead counters",
+    "The blocks built and their build time, the memory refs instrumented, "
+    "the flushes with the bytes and time written and the wrapped calls are "
+    "counted per thread and written to the info file at thread exit, the "
+    "totals and the calls per API at exit. With N the running totals are "
+    "also written every N seconds.");
+
 void
 event_exit(void)
 {
     bbtrace_exit();
 }
 
+/* drconfig -nudge_pid PID 0 N, see nudge.cmd */
+static void
+event_nudge(void *drcontext, uint64 argument)
+{
+    switch (argument) {
+        case NUDGE_PAUSE:
+            trigger_pause(true);
+            break;
+        case NUDGE_RESUME:
+            trigger_pause(false);
+            break;
+        case NUDGE_FLUSH:
+            bbtrace_flush(false);
+            break;
+        case NUDGE_ROTATE:
+            bbtrace_flush(true);
+            break;
+        default:
+            dr_printf("WARNING: Unknown nudge %d\n", (int)argument);
+    }
+}
+
 DR_EXPORT void
 dr_client_main(client_id_t id, int argc, const char *argv[])
 {
@@ -27,11 +198,70 @@ dr_client_main(client_id_t id, int argc, const char *argv[])
     if (!droption_parser_t::parse_argv(DROPTION_SCOPE_CLIENT, argc, argv, NULL, NULL))
         dr_printf("WARNING: Unable to parse_argv!\n");
 
-    bbtrace_init(id, enable_memtrace.get_value());
+    bbtrace_options_t options = {0};
+    options.enable_memtrace = enable_memtrace.get_value();
+    options.num_buffers = num_buffers.get_value();
+    options.enable_compact = enable_compact.get_value();
+    options.time_interval = time_interval.get_value();
+    options.buf_size = buf_size.get_value();
+    options.buf_max = buf_max.get_value();
+    options.large_pages = large_pages.get_value();
+    options.enable_mmap = enable_mmap.get_value();
+    options.ring_size = ring_size.get_value();
+    options.enable_mux = enable_mux.get_value();
+    options.ring_full = RING_FULL_BLOCK;
+    if (ring_full.get_value() == "drop")
+        options.ring_full = RING_FULL_DROP;
+    else if (ring_full.get_value() == "spill")
+        options.ring_full = RING_FULL_SPILL;
+    else if (ring_full.get_value() != "block")
+        dr_printf("WARNING: Unknown ring_full '%s', using block\n", ring_full.get_value().c_str());
+    options.trigger.start_offset = start_offset.get_value();
+    options.trigger.stop_offset = stop_offset.get_value();
+    options.trigger.start_call = start_call.get_value().c_str();
+    options.trigger.start_calls = start_calls.get_value();
+    options.trigger.start_blocks = start_blocks.get_value();
+    options.ranges = ranges.get_value().c_str();
+    options.ranges_file = ranges_file.get_value().c_str();
+    options.api_spec = api_spec.get_value().c_str();
+    options.demote = demote.get_value();
+    options.stats_interval = stats_interval.get_value();
+    options.trace_mode = TRACE_MODE_TRACE;
+    if (trace_mode.get_value() == "coverage")
+        options.trace_mode = TRACE_MODE_COVERAGE;
+    else if (trace_mode.get_value() == "branch")
+        options.trace_mode = TRACE_MODE_BRANCH;
+    else if (trace_mode.get_value() == "calls")
+        options.trace_mode = TRACE_MODE_CALLS;
+    else if (trace_mode.get_value() != "trace")
+        dr_printf("WARNING: Unknown mode '%s', using trace\n", trace_mode.get_value().c_str());
+
+    bbtrace_init(id, &options);
 
     dr_register_exit_event(event_exit);
+    dr_register_nudge_event(event_nudge, id);
 
     dr_enable_console_printing();
 
     dr_printf("Option: memtrace: %d\n", enable_memtrace.get_value());
+    dr_printf("Option: buffers: %d\n", num_buffers.get_value());
+    dr_printf("Option: buf_size: %d\n", buf_size.get_value());
+    dr_printf("Option: buf_max: %d\n", buf_max.get_value());
+    dr_printf("Option: large_pages: %d\n", large_pages.get_value());
+    dr_printf("Option: mmap: %d\n", enable_mmap.get_value());
+    dr_printf("Option: ring: %d\n", ring_size.get_value());
+    dr_printf("Option: ring_full: %s\n", ring_full.get_value().c_str());
+    dr_printf("Option: mux: %d\n", enable_mux.get_value());
+    dr_printf("Option: start_pc: 0x%x\n", start_offset.get_value());
+    dr_printf("Option: stop_pc: 0x%x\n", stop_offset.get_value());
+    dr_printf("Option: start_call: %s x%d\n", start_call.get_value().c_str(), start_calls.get_value());
+    dr_printf("Option: start_blocks: %d\n", start_blocks.get_value());
+    dr_printf("Option: ranges: %s\n", ranges.get_value().c_str());
+    dr_printf("Option: ranges_file: %s\n", ranges_file.get_value().c_str());
+    dr_printf("Option: api_spec: %s\n", api_spec.get_value().c_str());
+    dr_printf("Option: compact: %d\n", enable_compact.get_value());
+    dr_printf("Option: mode: %s\n", trace_mode.get_value().c_str());
+    dr_printf("Option: demote: %d\n", demote.get_value());
+    dr_printf("Option: time: %d\n", time_interval.get_value());
+    dr_printf("Option: stats: %d\n", stats_interval.get_value());
 }
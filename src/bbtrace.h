@@ -1,12 +1,73 @@
 #ifndef _BBTRACE_H_
 #define _BBTRACE_H_
 
+#include "trigger.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void bbtrace_init(client_id_t id, bool is_enable_memtrace);
+/* What the inserted instrumentation records */
+typedef enum {
+    TRACE_MODE_TRACE,       /* full block stream per thread */
+    TRACE_MODE_COVERAGE,    /* execution counter per block, dumped at exit */
+    TRACE_MODE_BRANCH,      /* branch outcomes and indirect targets only */
+    TRACE_MODE_CALLS,       /* blocks ending in a call or return and the next ones */
+} trace_mode_t;
+
+/* What a full live ring does with the next buffer */
+typedef enum {
+    RING_FULL_BLOCK,        /* wait for the consumer */
+    RING_FULL_DROP,         /* lose it, only counted */
+    RING_FULL_SPILL,        /* write it to the dump file */
+} ring_full_t;
+
+/* Nudge arguments, see nudge.cmd */
+typedef enum {
+    NUDGE_PAUSE = 1,        /* stop recording, blocks built plain */
+    NUDGE_RESUME,           /* record again */
+    NUDGE_FLUSH,            /* write out the buffers of every thread */
+    NUDGE_ROTATE,           /* same, then continue in new dump files */
+} bbtrace_nudge_t;
+
+typedef struct _bbtrace_options_t {
+    bool enable_memtrace;
+    /* number of trace buffers per thread, below 2 writes synchronously */
+    uint num_buffers;
+    /* write block ids, descriptors go to the .blocks file */
+    bool enable_compact;
+    trace_mode_t trace_mode;
+    /* executions of a block after which it is only counted, 0 never */
+    uint demote;
+    /* KB of trace between two time records, 0 for one per buffer flush */
+    uint time_interval;
+    /* KB of a trace buffer at thread start and as far as it may grow */
+    uint buf_size;
+    uint buf_max;
+    /* trace buffers in raw memory, on large pages when available */
+    bool large_pages;
+    /* trace buffers are mapped windows of the dump files */
+    bool enable_mmap;
+    /* MB of the shared memory ring streaming the buffers, 0 for dump files */
+    uint ring_size;
+    ring_full_t ring_full;
+    /* one dump file for all the threads */
+    bool enable_mux;
+    /* delayed start and stop of the recording */
+    trigger_options_t trigger;
+    /* only instrument blocks inside these "0xA-0xB,..." ranges, inline
+     * and from a file as printed by grapher */
+    const char *ranges;
+    const char *ranges_file;
+    /* file of the APIs to wrap and what to record of them */
+    const char *api_spec;
+    /* seconds between two dumps of the overhead counters, 0 only at exit */
+    uint stats_interval;
+} bbtrace_options_t;
+
+void bbtrace_init(client_id_t id, const bbtrace_options_t *options);
 void bbtrace_exit(void);
+void bbtrace_flush(bool rotate);
 file_t get_info_file();
 
 #ifdef __cplusplus
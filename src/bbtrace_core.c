@@ -1,8 +1,11 @@
 #include "dr_api.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "drmgr.h"
 #include "drutil.h"
 #include "drwrap.h"
+#include "drx.h"
+#include "drreg.h"
 #include "hashtable.h"
 #include "drvector.h"
 #include <intrin.h>
@@ -15,23 +18,55 @@
 #include "winapi.h"
 #include "datatypes.h"
 #include "synchro.h"
+#include "writer.h"
+#include "blocks.h"
+#include "modules.h"
+#include "rangetree.h"
+#include "ring.h"
+#include "mux.h"
+#include "trigger.h"
+#include "stats.h"
+#include "intern.h"
 #include "bbtrace_core.h"
 
 #pragma intrinsic(__rdtsc)
+#pragma intrinsic(_InterlockedIncrement)
+#pragma intrinsic(_InterlockedExchange)
 
 static bool enable_memtrace = false;
+static uint num_buffers = 1;
+static bool enable_compact = false;
+static trace_mode_t trace_mode = TRACE_MODE_TRACE;
+/* bytes of trace between two time records, 0 only stamps the flushes */
+static uint time_interval = 0;
+/* trace buffer size of a new thread, as far as it may grow, and whether
+ * the buffers are raw memory on large pages when available */
+static size_t buf_init_size = MEM_BUF_SIZE;
+static size_t buf_max_size = MEM_BUF_SIZE;
+static bool large_pages = false;
+/* large page size when the token has SeLockMemoryPrivilege enabled, else 0 */
+static SIZE_T large_page_size = 0;
+/* trace buffers are windows of the mapped dump files */
+static bool enable_mmap = false;
+/* executions after which a jump block is only counted, 0 never */
+static uint demote_threshold = 0;
 #define WITH_BBTRACE 1
 #define WITH_APPCALL 0
 #define WITH_LIBCALL 1
 #define ONLY_WINAPI 1
 
 static file_t info_file;
-static drvector_t vec_dynamic_codes;
+static rangetree_t tree_dynamic_codes;
+/* hull of everything ever added, rejects most pcs without the lock */
 static range_t rng_dynamic_codes;
+/* with -ranges only the blocks starting inside these are instrumented */
+static rangetree_t tree_selected;
+static bool enable_ranges = false;
 
 static module_data_t *app_exe = 0;
 static thread_id_t main_thread_id = 0;
-static bool enter_main = false;
+/* threads started so far, the serial of the next one */
+static volatile long thread_serials = 0;
 static int tls_index;
 static char dump_path[MAXIMUM_PATH];
 
@@ -42,10 +77,25 @@ static void event_thread_exit(void *drcontext);
 static bool is_from_exe(app_pc pc, bool lookup);
 static bool is_dynamic_code(app_pc pc);
 static void dump_data(void *drcontext);
+static void flush_data(void *drcontext);
 static void dump_thread_mcontext(void *drcontext);
 
 static app_pc g_funCreateThread = 0;
 
+/* wrapped winapi calls nested deeper than this fall back to the heap */
+#define LIB_SLAB_DEPTH 64
+
+/* smallest trace buffer, it holds the records of a block of DR's maximum size */
+#define BUF_MIN_SIZE (64 * 1024)
+
+/* a thread filling this many buffers at its current size within about a
+ * second of time stamp counter gets twice larger ones */
+#define BUF_GROW_FLUSHES 4
+#define BUF_GROW_TICKS ((uint64)1 << 31)
+
+/* a time mark only goes in while any writer still finds its room after it */
+#define TIME_ROOM BUF_MIN_SIZE
+
 /* thread private log file and counter */
 typedef struct {
     char   *buf_ptr;
@@ -53,16 +103,280 @@ typedef struct {
     /* buf_end holds the negative value of real address of buffer end. */
     ptr_int_t buf_end;
     file_t dump_f;
-    uint loop_xcx;
-    app_pc loop_pc;
+    /* of the thread in the run, tags its -mux chunks as Windows reuses tids */
+    uint   serial;
+    /* buffers rotated through the writer, busy while being written out */
+    char   *bufs[MAX_WRITER_BUFFERS];
+    size_t buf_sizes[MAX_WRITER_BUFFERS];
+    bool   buf_large[MAX_WRITER_BUFFERS];
+    volatile long buf_busy[MAX_WRITER_BUFFERS];
+    uint   buf_idx;
+    /* size the buffers grow to, flushes done at that size */
+    size_t buf_want;
+    uint   grow_flushes;
+    uint64 grow_ts;
+    uint   stalls;
+    /* overhead counters, flushes among them */
+    tracer_stats_t stats;
+    /* headers of the chunks written so far, the index of the dump file */
+    buf_chunk_t *chunks;
+    uint   num_chunks;
+    uint   max_chunks;
+    uint64 file_pos;
+    /* buf_ptr right after the record of a block that may repeat, its tag
+     * (pc or compact id) and how many times it ran again since */
+    char   *repeat_end;
+    uint   repeat_tag;
+    uint   repeat_count;
+    /* branch mode: the next block records itself, taken bits not written */
+    uint   want_target;
+    uint   tnt_count;
+    uint   tnt_bits[TNT_BITS / 32];
+    /* calls mode: the last traced block was a call or a return, the next
+     * one records itself */
+    uint   link_pending;
+    /* user data of the wrapped calls in progress, used as a stack */
+    wrap_lib_user_t *lib_slab;
+    uint   lib_depth;
+    /* interned strings whose text this dump has, a bit per id */
+    uint   *strings_sent;
     bool dump_mcontext;
+    /* dump file, and how many times it was rotated */
+    char dump_name[MAXIMUM_PATH];
+    uint rotations;
+    /* NUDGE_FLUSH or NUDGE_ROTATE, done at the next record */
+    volatile uint nudge;
+    /* -mmap: bufs[0] is a view of the dump file at file_pos */
+    bool   mapped;
+    HANDLE map_handle;
+    char   *map_view;
 } per_thread_t;
 
+static void flush_pending(void *drcontext, per_thread_t *thd_data);
+static void write_time(per_thread_t *thd_data);
+static void chunk_begin(per_thread_t *thd_data);
+static void chunk_write_index(per_thread_t *thd_data);
+static void set_buf_end(per_thread_t *thd_data);
+
 typedef struct {
     instr_t *first_instr;
-    app_pc loop_stop_pc;
+    /* all records of the block are reserved at its entry:
+     * the block record followed by one slot per memory ref or loop,
+     * slots keep the static part of the record (all but the address) */
+    mem_ref_t *slots;
+    uint *slot_offs;
+    uint num_slots;
+    uint next_slot;
+    uint record_size;
+    uint total_size;
+    /* register untouched by the block to hold the end of the records */
+    reg_id_t hold_reg;
+    reg_id_t reg_ptr;
+    /* branch mode: BRANCH_* of the block, set at its entry */
+    uint branch;
+    /* exe or dynamic code, traced once the start trigger fired */
+    bool in_scope;
+    /* -demote: execution counter of the block, whether it went hot */
+    uint *counter;
+    uint block_id;
+    bool demoted;
+    /* time stamp counter at the start of the build */
+    uint64 build_ts;
 } user_data_t;
 
+/* ------------------------------------------------------------------------- */
+/* Trace buffers come from the thread heap, or with -large_pages from raw
+ * memory, on large pages when the privilege for them is enabled.
+ */
+static char *
+buf_alloc(void *drcontext, size_t *size, bool *large)
+{
+    char *buf;
+    SIZE_T page = large_page_size;
+
+    *large = false;
+    if (!large_pages)
+        return dr_thread_alloc(drcontext, *size);
+
+    if (page) {
+        SIZE_T rounded = (*size + page - 1) & ~(page - 1);
+        buf = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+            PAGE_READWRITE);
+        if (buf) {
+            *size = rounded;
+            *large = true;
+            return buf;
+        }
+    }
+
+    return dr_raw_mem_alloc(*size, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+}
+
+static void
+buf_free(void *drcontext, char *buf, size_t size, bool large)
+{
+    if (large)
+        VirtualFree(buf, 0, MEM_RELEASE);
+    else if (large_pages)
+        dr_raw_mem_free(buf, size);
+    else
+        dr_thread_free(drcontext, buf, size);
+}
+
+/* Large pages need SeLockMemoryPrivilege enabled in the token of the app,
+ * only looked up: the token is the app's, not ours to change.
+ */
+static bool
+lock_memory_enabled(void)
+{
+    HANDLE token;
+    LUID luid;
+    DWORD info[256], len, i;
+    TOKEN_PRIVILEGES *privs = (TOKEN_PRIVILEGES*)info;
+    bool ok = false;
+
+    if (!LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &luid) ||
+        !OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token))
+        return false;
+
+    if (GetTokenInformation(token, TokenPrivileges, info, sizeof(info), &len)) {
+        for (i = 0; i < privs->PrivilegeCount; i++) {
+            if (privs->Privileges[i].Luid.LowPart == luid.LowPart &&
+                privs->Privileges[i].Luid.HighPart == luid.HighPart) {
+                ok = (privs->Privileges[i].Attributes & SE_PRIVILEGE_ENABLED) != 0;
+                break;
+            }
+        }
+    }
+    CloseHandle(token);
+
+    return ok;
+}
+
+/* A thread flushing often gets larger buffers, each one is replaced when
+ * it comes up for use again (the writer may still hold the others). The
+ * flushes count within a window of BUF_GROW_TICKS, a slow thread keeps
+ * its size however long it runs.
+ */
+static void
+buf_grow(void *drcontext, per_thread_t *thd_data)
+{
+    uint idx = thd_data->buf_idx;
+    uint64 now = __rdtsc();
+
+    if (now - thd_data->grow_ts > BUF_GROW_TICKS) {
+        thd_data->grow_ts = now;
+        thd_data->grow_flushes = 0;
+    }
+    if (thd_data->buf_want < buf_max_size &&
+        ++thd_data->grow_flushes >= BUF_GROW_FLUSHES) {
+        thd_data->grow_ts = now;
+        thd_data->grow_flushes = 0;
+        thd_data->buf_want *= 2;
+        if (thd_data->buf_want > buf_max_size)
+            thd_data->buf_want = buf_max_size;
+    }
+
+    /* a mapped window takes the new size when it moves on */
+    if (thd_data->mapped) return;
+
+    if (thd_data->buf_sizes[idx] < thd_data->buf_want) {
+        buf_free(drcontext, thd_data->bufs[idx], thd_data->buf_sizes[idx],
+            thd_data->buf_large[idx]);
+        thd_data->buf_sizes[idx] = thd_data->buf_want;
+        thd_data->bufs[idx] = buf_alloc(drcontext, &thd_data->buf_sizes[idx],
+            &thd_data->buf_large[idx]);
+    }
+}
+
+/* With -mmap the buffer is a window of the dump file starting at file_pos,
+ * the system writes it out even when the process dies and a flush only
+ * moves the window on. Views start on the 64K allocation granularity, the
+ * window begins inside the first 64K of its view.
+ */
+#define MAP_GRANULARITY 0x10000
+
+static file_t
+map_open_file(const char *path)
+{
+    /* the mapping needs read access too, unlike dr_open_file */
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+        NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    return file == INVALID_HANDLE_VALUE ? INVALID_FILE : (file_t)file;
+}
+
+static void
+map_unmap(per_thread_t *thd_data)
+{
+    if (thd_data->map_view)
+        UnmapViewOfFile(thd_data->map_view);
+    if (thd_data->map_handle)
+        CloseHandle(thd_data->map_handle);
+    thd_data->map_view = NULL;
+    thd_data->map_handle = NULL;
+}
+
+/* Map buf_want bytes of the file from file_pos as bufs[0], the mapping
+ * extends the file as needed */
+static bool
+map_window(per_thread_t *thd_data)
+{
+    uint64 view_pos = thd_data->file_pos & ~(uint64)(MAP_GRANULARITY - 1);
+    size_t skip = (size_t)(thd_data->file_pos - view_pos);
+    size_t view_size = skip + thd_data->buf_want;
+    uint64 map_end = view_pos + view_size;
+
+    map_unmap(thd_data);
+    thd_data->mapped = false;
+    if (thd_data->dump_f == INVALID_FILE) return false;
+
+    thd_data->map_handle = CreateFileMappingA((HANDLE)thd_data->dump_f, NULL, PAGE_READWRITE,
+        (DWORD)(map_end >> 32), (DWORD)map_end, NULL);
+    if (thd_data->map_handle == NULL) return false;
+
+    thd_data->map_view = MapViewOfFile(thd_data->map_handle, FILE_MAP_WRITE,
+        (DWORD)(view_pos >> 32), (DWORD)view_pos, view_size);
+    if (thd_data->map_view == NULL) {
+        map_unmap(thd_data);
+        return false;
+    }
+
+    thd_data->bufs[0] = thd_data->map_view + skip;
+    thd_data->buf_sizes[0] = thd_data->buf_want;
+    thd_data->buf_large[0] = false;
+    thd_data->mapped = true;
+    return true;
+}
+
+/* Drop the window and cut the file back to what was recorded, later
+ * writes go on from there */
+static void
+map_close(per_thread_t *thd_data)
+{
+    LARGE_INTEGER pos;
+
+    map_unmap(thd_data);
+    thd_data->mapped = false;
+    thd_data->bufs[0] = NULL;
+
+    pos.QuadPart = (LONGLONG)thd_data->file_pos;
+    SetFilePointerEx((HANDLE)thd_data->dump_f, pos, NULL, FILE_BEGIN);
+    SetEndOfFile((HANDLE)thd_data->dump_f);
+}
+
+/* The window moved on, or a plain buffer when the mapping failed */
+static void
+map_advance(void *drcontext, per_thread_t *thd_data)
+{
+    if (map_window(thd_data)) return;
+
+    dr_printf("WARNING: Cannot map the dump file, writing it instead\n");
+    map_close(thd_data);
+    thd_data->buf_sizes[0] = thd_data->buf_want;
+    thd_data->bufs[0] = buf_alloc(drcontext, &thd_data->buf_sizes[0], &thd_data->buf_large[0]);
+}
+
 // Hack
 static void
 nop_delay(uint rep)
@@ -75,6 +389,96 @@ nop_delay(uint rep)
 }
 
 /* ------------------------------------------------------------------------- */
+/* Wrapped calls return in the reverse order they were made on a thread,
+ * their user data is pushed and popped from the per thread slab.
+ */
+static wrap_lib_user_t *
+lib_user_alloc(per_thread_t *thd_data)
+{
+    if (thd_data->lib_depth < LIB_SLAB_DEPTH)
+        return &thd_data->lib_slab[thd_data->lib_depth++];
+    return dr_global_alloc(sizeof(wrap_lib_user_t));
+}
+
+static void
+lib_user_free(per_thread_t *thd_data, wrap_lib_user_t *p_data)
+{
+    if (p_data >= thd_data->lib_slab && p_data < thd_data->lib_slab + LIB_SLAB_DEPTH) {
+        /* calls never returned from (longjmp, exception) are popped too */
+        uint depth = (uint)(p_data - thd_data->lib_slab);
+        if (depth < thd_data->lib_depth)
+            thd_data->lib_depth = depth;
+    } else {
+        dr_global_free(p_data, sizeof(wrap_lib_user_t));
+    }
+}
+
+/* A string arg is whatever the app passed: an empty string for NULL,
+ * "(bad ptr)" when reading it faults.
+ */
+static void
+copy_app_string(void *drcontext, char *dst, const char *src, size_t size)
+{
+    dst[0] = '\0';
+    if (!src) return;
+    DR_TRY_EXCEPT(drcontext, {
+        strncpy(dst, src, size - 1);
+    }, { /* EXCEPT */
+        strncpy(dst, "(bad ptr)", size - 1);
+    });
+    dst[size - 1] = '\0';
+}
+
+/* A string arg: its id once this dump has the text, the text with the id
+ * the first time, the text alone when the intern table is full.
+ */
+static void
+trace_string(void *drcontext, per_thread_t *thd_data, const char *str)
+{
+    buf_string_def_t buf_def = {0};
+    uint id;
+
+    copy_app_string(drcontext, buf_def.value, str, sizeof(buf_def.value));
+    id = intern_string(buf_def.value);
+
+    flush_pending(drcontext, thd_data);
+
+    if (id == INTERN_NONE) {
+        buf_string_t buf_str = {0};
+        buf_str.kind = KIND_STRING;
+        copy_app_string(drcontext, buf_str.value, str, sizeof(buf_str.value));
+        if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_string_t)) >= -thd_data->buf_end)
+            dump_data(drcontext);
+        *(buf_string_t*)thd_data->buf_ptr = buf_str;
+        thd_data->buf_ptr += sizeof(buf_string_t);
+        return;
+    }
+
+    if (!thd_data->strings_sent) {
+        thd_data->strings_sent = dr_thread_alloc(drcontext, INTERN_MAX / 8);
+        memset(thd_data->strings_sent, 0, INTERN_MAX / 8);
+    }
+
+    if (thd_data->strings_sent[id / 32] & (1 << (id % 32))) {
+        buf_string_ref_t buf_ref = {0};
+        buf_ref.kind = KIND_STRING_REF;
+        buf_ref.id = id;
+        if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_string_ref_t)) >= -thd_data->buf_end)
+            dump_data(drcontext);
+        *(buf_string_ref_t*)thd_data->buf_ptr = buf_ref;
+        thd_data->buf_ptr += sizeof(buf_string_ref_t);
+        return;
+    }
+
+    thd_data->strings_sent[id / 32] |= 1 << (id % 32);
+    buf_def.kind = KIND_STRING_DEF;
+    buf_def.id = id;
+    if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_string_def_t)) >= -thd_data->buf_end)
+        dump_data(drcontext);
+    *(buf_string_def_t*)thd_data->buf_ptr = buf_def;
+    thd_data->buf_ptr += sizeof(buf_string_def_t);
+}
+
 void
 lib_entry(void *wrapcxt, INOUT void **user_data)
 {
@@ -94,7 +498,10 @@ lib_entry(void *wrapcxt, INOUT void **user_data)
     });
 #endif
 
-    sym_info_item_t *sym_info = syminfo_get(func);
+    /* handed over at wrap time, lib_exit gets what is left in there */
+    sym_info_item_t *sym_info = *user_data;
+    *user_data = NULL;
+    if (!sym_info) sym_info = syminfo_get(func);
     if (!sym_info) return;
 
     if (func != g_funCreateThread) {
@@ -108,7 +515,6 @@ lib_entry(void *wrapcxt, INOUT void **user_data)
     data.sym_info = *sym_info;
     if (!data.verbose) return;
 
-    buf_string_t buf_str = {0};
     buf_lib_call_t buf_item = {0};
     buf_item.kind = KIND_LIB_CALL;
     buf_item.func = func;
@@ -117,33 +523,30 @@ lib_entry(void *wrapcxt, INOUT void **user_data)
     DR_ASSERT(6 * sizeof(mem_ref_t) == sizeof(buf_string_t));
 
     wrap_lib_user_t *p_data;
-    if (sym_info->winapi_info) {
-        p_data = dr_global_alloc(sizeof(wrap_lib_user_t));
+    thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    if (sym_info->winapi_info && !sym_info->winapi_info->call_only) {
+        p_data = lib_user_alloc(thd_data);
         *p_data = data;
         *user_data = p_data;
     } else {
         p_data = &data;
     }
 
-    // WINAPI: save args and strings
+    // WINAPI: save args
     uint nargs = 0;
     if (sym_info->winapi_info) {
         nargs = sym_info->winapi_info->nargs;
         for (uint a = 0; a < nargs; a++) {
             p_data->args[a] = drwrap_get_arg(wrapcxt, a);
-            // Capture only arg-0
-            if (a == 0) {
-                buf_item.arg = (uint)p_data->args[a];
-                if (sym_info->winapi_info->targs[a] == A_LPSTR) {
-                    buf_str.kind = KIND_STRING;
-                    strncpy(buf_str.value, (char*)p_data->args[a], sizeof(buf_str.value));
-                }
-            }
         }
+        // Capture only arg-0
+        if (nargs) buf_item.arg = (uint)p_data->args[0];
     }
 
     // trace lib call
-    thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    thd_data->stats.lib_calls++;
+    _InterlockedIncrement(&sym_info->calls);
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_lib_call_t)) >= -thd_data->buf_end)
         dump_data(drcontext);
     *(buf_lib_call_t*)thd_data->buf_ptr = buf_item;
@@ -161,11 +564,10 @@ lib_entry(void *wrapcxt, INOUT void **user_data)
 
     // WINAPI: trace strings
     if (sym_info->winapi_info) {
-        if (buf_str.kind == KIND_STRING) {
-            if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_string_t)) >= -thd_data->buf_end)
-                dump_data(drcontext);
-            *(buf_string_t*)thd_data->buf_ptr = buf_str;
-            thd_data->buf_ptr += sizeof(buf_string_t);
+        for (uint a = 0; a < nargs; a++) {
+            if (sym_info->winapi_info->targs[a] != A_LPSTR) continue;
+
+            trace_string(drcontext, thd_data, (const char*)p_data->args[a]);
         }
 
         // NOTE: hooks usually already saved the args
@@ -177,12 +579,27 @@ lib_entry(void *wrapcxt, INOUT void **user_data)
                     buf_args.params[b] = (uint)p_data->args[a];
                 }
 
+                flush_pending(drcontext, thd_data);
                 if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_event_t)) >= -thd_data->buf_end)
                     dump_data(drcontext);
                 *(buf_event_t*)thd_data->buf_ptr = buf_args;
                 thd_data->buf_ptr += sizeof(buf_event_t);
             }
         }
+
+        // not wrapped on its way out, it returns right here for the parser
+        if (sym_info->winapi_info->call_only) {
+            buf_lib_ret_t buf_ret = {0};
+            buf_ret.kind = KIND_LIB_RET;
+            buf_ret.func = func;
+            buf_ret.ret_addr = ret_addr;
+
+            flush_pending(drcontext, thd_data);
+            if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_lib_ret_t)) >= -thd_data->buf_end)
+                dump_data(drcontext);
+            *(buf_lib_ret_t*)thd_data->buf_ptr = buf_ret;
+            thd_data->buf_ptr += sizeof(buf_lib_ret_t);
+        }
     }
 }
 
@@ -227,6 +644,7 @@ lib_exit(void *wrapcxt, INOUT void *user_data)
     }
 
     thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_lib_ret_t)) >= -thd_data->buf_end)
         dump_data(drcontext);
     *(buf_lib_ret_t*)thd_data->buf_ptr = buf_item;
@@ -240,8 +658,52 @@ lib_exit(void *wrapcxt, INOUT void *user_data)
     }
 
     if (p_data) {
-        dr_global_free(p_data, sizeof(wrap_lib_user_t));
+        lib_user_free(thd_data, p_data);
+    }
+}
+
+/* Coverage mode: the calls adding or removing dynamic code only run their
+ * hooks, nothing is recorded.
+ */
+static void
+cover_entry(void *wrapcxt, INOUT void **user_data)
+{
+    sym_info_item_t *sym_info = syminfo_get(drwrap_get_func(wrapcxt));
+    winapi_info_t *winapi_info;
+    wrap_lib_user_t *p_data;
+
+    *user_data = NULL;
+    if (!sym_info || !sym_info->winapi_info) return;
+    winapi_info = sym_info->winapi_info;
+
+    p_data = dr_global_alloc(sizeof(wrap_lib_user_t));
+    memset(p_data, 0, sizeof(wrap_lib_user_t));
+    p_data->sym_info = *sym_info;
+    for (uint a = 0; a < winapi_info->nargs; a++) {
+        p_data->args[a] = drwrap_get_arg(wrapcxt, a);
+    }
+    if (winapi_info->pre_hook)
+        winapi_info->pre_hook(wrapcxt, (void*)p_data);
+    *user_data = p_data;
+}
+
+static void
+cover_exit(void *wrapcxt, INOUT void *user_data)
+{
+    wrap_lib_user_t *p_data = user_data;
+    winapi_info_t *winapi_info;
+
+    if (!p_data) return;
+    winapi_info = p_data->sym_info.winapi_info;
+
+    /* no wrapcxt when the call was unwound by an exception */
+    if (wrapcxt) {
+        if (winapi_info->tret != A_VOID)
+            p_data->retval = drwrap_get_retval(wrapcxt);
+        if (winapi_info->post_hook)
+            winapi_info->post_hook(wrapcxt, (void*)p_data);
     }
+    dr_global_free(p_data, sizeof(wrap_lib_user_t));
 }
 
 /* ------------------------------------------------------------------------- */
@@ -293,19 +755,23 @@ iterate_exports(void * drcontext, const module_data_t *mod, bool add)
 
     if (shared_dll == NO_DLL) return;
 
-    buf_item.kind = KIND_MODULE;
-    buf_item.entry_point = mod->entry_point;
-    buf_item.start = (uint) mod->start;
-    buf_item.end = (uint) mod->end;
-    buf_item.shared_dll = shared_dll;
-    strncpy(buf_item.name, mod_name, sizeof(buf_item.name));
-
-    DR_ASSERT(2 * sizeof(mem_ref_t) == sizeof(buf_module_t));
-    thd_data = drmgr_get_tls_field(drcontext, tls_index);
-    if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_module_t)) >= -thd_data->buf_end)
-        dump_data(drcontext);
-    *(buf_module_t*)thd_data->buf_ptr = buf_item;
-    thd_data->buf_ptr += sizeof(buf_module_t);
+    /* coverage mode has no dump to record it in */
+    if (trace_mode != TRACE_MODE_COVERAGE) {
+        buf_item.kind = KIND_MODULE;
+        buf_item.entry_point = mod->entry_point;
+        buf_item.start = (uint) mod->start;
+        buf_item.end = (uint) mod->end;
+        buf_item.shared_dll = shared_dll;
+        strncpy(buf_item.name, mod_name, sizeof(buf_item.name));
+
+        DR_ASSERT(2 * sizeof(mem_ref_t) == sizeof(buf_module_t));
+        thd_data = drmgr_get_tls_field(drcontext, tls_index);
+        flush_pending(drcontext, thd_data);
+        if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_module_t)) >= -thd_data->buf_end)
+            dump_data(drcontext);
+        *(buf_module_t*)thd_data->buf_ptr = buf_item;
+        thd_data->buf_ptr += sizeof(buf_module_t);
+    }
 
     dr_symbol_export_iterator_t *exp_iter =
         dr_symbol_export_iterator_start(mod->handle);
@@ -315,7 +781,7 @@ iterate_exports(void * drcontext, const module_data_t *mod, bool add)
         app_pc func = sym->addr;
 
         if (sym->is_code && func) {
-            winapi_info_t *winapi_info = winapi_get(sym->name);
+            winapi_info_t *winapi_info = winapi_lookup(sym->name, shared_dll);
 
             if (add) {
                 sym_info_item_t *sym_info = dr_global_alloc(sizeof(sym_info_item_t));
@@ -324,13 +790,25 @@ iterate_exports(void * drcontext, const module_data_t *mod, bool add)
                 sym_info->sym.ordinal = sym->ordinal;
                 sym_info->shared_dll = shared_dll;
                 sym_info->winapi_info = winapi_info;
+                sym_info->calls = 0;
 
                 syminfo_add(func, sym_info);
-                if (is_wrapping_symbol(sym_info)) {
-                    drwrap_wrap(func, lib_entry, lib_exit);
+                if (trace_mode == TRACE_MODE_COVERAGE) {
+                    if (winapi_tracks_code(winapi_info))
+                        drwrap_wrap(func, cover_entry, cover_exit);
+                } else if (is_wrapping_symbol(sym_info)) {
+                    drwrap_wrap_ex(func, lib_entry,
+                        winapi_info && winapi_info->call_only ? NULL : lib_exit,
+                        sym_info, 0);
                 }
+            } else if (trace_mode == TRACE_MODE_COVERAGE) {
+                if (winapi_tracks_code(winapi_info))
+                    drwrap_unwrap(func, cover_entry, cover_exit);
+
+                syminfo_remove(func);
             } else {
-                drwrap_unwrap(func, lib_entry, lib_exit);
+                drwrap_unwrap(func, lib_entry,
+                    winapi_info && winapi_info->call_only ? NULL : lib_exit);
 
                 syminfo_remove(func);
             }
@@ -342,6 +820,9 @@ iterate_exports(void * drcontext, const module_data_t *mod, bool add)
 static void
 event_module_load(void *drcontext, const module_data_t *mod, bool loaded)
 {
+    modules_add(mod, mod->start == app_exe->start);
+    trigger_module_load(mod);
+
     if (mod->start != app_exe->start)
         iterate_exports(drcontext, mod, true/*add*/);
 }
@@ -349,6 +830,9 @@ event_module_load(void *drcontext, const module_data_t *mod, bool loaded)
 static void
 event_module_unload(void *drcontext, const module_data_t *mod)
 {
+    modules_remove(mod);
+    trigger_module_unload(mod);
+
     if (mod->start != app_exe->start)
         iterate_exports(drcontext, mod, false/*remove*/);
 }
@@ -366,6 +850,7 @@ WndProc_entry(void *wrapcxt, INOUT void **user_data)
     for (int a=0; a<3; a++) buf_item.params[a] = (uint)drwrap_get_arg(wrapcxt, a+1);
     DR_ASSERT(sizeof(buf_event_t) % sizeof(mem_ref_t) == 0);
 
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_event_t)) >= -thd_data->buf_end) dump_data(drcontext);
     *(buf_event_t*)thd_data->buf_ptr = buf_item;
     thd_data->buf_ptr += sizeof(buf_event_t);
@@ -383,17 +868,20 @@ dump_thread_mcontext(void *drcontext)
 
     if (! dr_get_mcontext(drcontext, &mcontext)) return;
 
-    buf_event_t buf_item = {0};
-    buf_item.kind = KIND_THREAD;
-    buf_item.params[0] = thread_id;
-    buf_item.params[1] = mcontext.xsp;
-    buf_item.params[2] = mcontext.xflags;
-    DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_event_t));
-
-    if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_event_t)) >= -thd_data->buf_end)
-        dump_data(drcontext);
-    *(buf_event_t*)thd_data->buf_ptr = buf_item;
-    thd_data->buf_ptr += sizeof(buf_event_t);
+    if (trace_mode != TRACE_MODE_COVERAGE) {
+        buf_event_t buf_item = {0};
+        buf_item.kind = KIND_THREAD;
+        buf_item.params[0] = thread_id;
+        buf_item.params[1] = mcontext.xsp;
+        buf_item.params[2] = mcontext.xflags;
+        DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_event_t));
+
+        flush_pending(drcontext, thd_data);
+        if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_event_t)) >= -thd_data->buf_end)
+            dump_data(drcontext);
+        *(buf_event_t*)thd_data->buf_ptr = buf_item;
+        thd_data->buf_ptr += sizeof(buf_event_t);
+    }
 
     thd_data->dump_mcontext = true;
 
@@ -415,22 +903,57 @@ event_thread_init(void *drcontext)
     } else {
         dr_snprintf(path, sizeof(path), "%s.bin.%d", dump_path, thread_id);
     }
+    /* all in one file, no dump of its own */
+    if (mux_enabled())
+        dr_snprintf(path, sizeof(path), "%s.mux", dump_path);
 
     /* allocate thread private data */
     thd_data = dr_thread_alloc(drcontext, sizeof(per_thread_t));
+    memset(thd_data, 0, sizeof(per_thread_t));
     drmgr_set_tls_field(drcontext, tls_index, thd_data);
-    thd_data->buf_base = dr_thread_alloc(drcontext, MEM_BUF_SIZE);
-    thd_data->buf_ptr  = thd_data->buf_base;
-    /* set buf_end to be negative of address of buffer end for the lea later */
-    thd_data->buf_end  = -(ptr_int_t)(thd_data->buf_base + MEM_BUF_SIZE);
+    thd_data->serial = (uint)_InterlockedIncrement(&thread_serials) - 1;
+    stats_thread_init(&thd_data->stats);
+
+    /* the counters are global, a thread has no buffer nor dump of its own */
+    if (trace_mode == TRACE_MODE_COVERAGE) {
+        thd_data->dump_f = INVALID_FILE;
+        dr_fprintf(info_file, "tid:%d%s,serial:%u\n", thread_id,
+            main_thread_id == thread_id ? ",main" : "", thd_data->serial);
+        return;
+    }
 
-    thd_data->dump_f = dr_open_file(path, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
-    thd_data->loop_xcx = 0;
+    thd_data->buf_want = buf_init_size;
+    if (enable_mmap) {
+        thd_data->dump_f = map_open_file(path);
+        if (!map_window(thd_data))
+            dr_printf("%d] WARNING: Cannot map the dump file, writing it instead\n", thread_id);
+    }
+    for (uint i = 0; i < num_buffers && !thd_data->mapped; i++) {
+        thd_data->buf_sizes[i] = buf_init_size;
+        thd_data->bufs[i] = buf_alloc(drcontext, &thd_data->buf_sizes[i], &thd_data->buf_large[i]);
+    }
+    thd_data->lib_slab = dr_thread_alloc(drcontext, LIB_SLAB_DEPTH * sizeof(wrap_lib_user_t));
+    thd_data->lib_depth = 0;
+    thd_data->buf_idx  = 0;
+    thd_data->buf_base = thd_data->bufs[0];
+    thd_data->buf_ptr  = thd_data->buf_base;
+    chunk_begin(thd_data);
+    set_buf_end(thd_data);
+
+    if (mux_enabled())
+        thd_data->dump_f = INVALID_FILE;
+    else if (!enable_mmap)
+        thd_data->dump_f = dr_open_file(path, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    dr_snprintf(thd_data->dump_name, sizeof(thd_data->dump_name), "%s", path);
     thd_data->dump_mcontext = false;
+    /* nothing leads to the first block */
+    thd_data->want_target = 1;
+    thd_data->link_pending = 1;
 
     char *is_main = "";
     if (main_thread_id == thread_id) is_main = ",main";
-    dr_fprintf(info_file, "tid:%d%s,dump:%s\n", thread_id, is_main, path);
+    dr_fprintf(info_file, "tid:%d%s,serial:%u,dump:%s\n", thread_id, is_main,
+        thd_data->serial, path);
     dr_printf("%d] Open dump file: %s\n", thread_id, path);
 }
 
@@ -438,14 +961,47 @@ static void
 event_thread_exit(void *drcontext)
 {
     per_thread_t *thd_data;
+    thread_id_t thread_id = dr_get_thread_id(drcontext);
 
-    dump_data(drcontext);
     thd_data = drmgr_get_tls_field(drcontext, tls_index);
-    thd_data->dump_f;
-
-    dr_close_file(thd_data->dump_f);
+    if (trace_mode == TRACE_MODE_COVERAGE) {
+        stats_thread_exit(thread_id, &thd_data->stats);
+        dr_thread_free(drcontext, thd_data, sizeof(per_thread_t));
+        return;
+    }
+    flush_data(drcontext);
 
-    dr_thread_free(drcontext, thd_data->buf_base, MEM_BUF_SIZE);
+    /* the writer may still hold our buffers */
+    for (uint i = 0; i < num_buffers; i++) {
+        writer_wait(&thd_data->buf_busy[i]);
+    }
+    if (thd_data->mapped)
+        map_close(thd_data);
+
+    if (!ring_enabled() && thd_data->dump_f != INVALID_FILE)
+        chunk_write_index(thd_data);
+    if (thd_data->dump_f != INVALID_FILE)
+        dr_close_file(thd_data->dump_f);
+    if (ring_enabled())
+        ring_write(ring_thread_id(drcontext), NULL, 0);
+
+    dr_fprintf(info_file, "tid:%d,flushes:%u,stalls:%u,buf_kb:%u\n",
+        thread_id, (uint)thd_data->stats.flushes, thd_data->stalls,
+        (uint)(thd_data->buf_want / 1024));
+    if (thd_data->stalls)
+        dr_printf("%d] Writer stalls: %u of %u flushes\n", thread_id,
+            thd_data->stalls, (uint)thd_data->stats.flushes);
+    stats_thread_exit(thread_id, &thd_data->stats);
+
+    for (uint i = 0; i < num_buffers; i++) {
+        if (thd_data->bufs[i])
+            buf_free(drcontext, thd_data->bufs[i], thd_data->buf_sizes[i], thd_data->buf_large[i]);
+    }
+    if (thd_data->chunks)
+        dr_thread_free(drcontext, thd_data->chunks, thd_data->max_chunks * sizeof(buf_chunk_t));
+    dr_thread_free(drcontext, thd_data->lib_slab, LIB_SLAB_DEPTH * sizeof(wrap_lib_user_t));
+    if (thd_data->strings_sent)
+        dr_thread_free(drcontext, thd_data->strings_sent, INTERN_MAX / 8);
     dr_thread_free(drcontext, thd_data, sizeof(per_thread_t));
 }
 
@@ -463,10 +1019,16 @@ event_exception(void *drcontext, dr_exception_t *excpt)
     DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_exception_t));
 
     thd_data = drmgr_get_tls_field(drcontext, tls_index);
-    if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_exception_t)) >= -thd_data->buf_end)
-        dump_data(drcontext);
-    *(buf_exception_t*)thd_data->buf_ptr = buf_item;
-    thd_data->buf_ptr += sizeof(buf_exception_t);
+    if (trace_mode != TRACE_MODE_COVERAGE) {
+        flush_pending(drcontext, thd_data);
+        if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_exception_t)) >= -thd_data->buf_end)
+            dump_data(drcontext);
+        *(buf_exception_t*)thd_data->buf_ptr = buf_item;
+        thd_data->buf_ptr += sizeof(buf_exception_t);
+    }
+    /* the handler is not reached by any branch */
+    thd_data->want_target = 1;
+    thd_data->link_pending = 1;
 
     dr_fprintf(info_file, "tid:%d,exception:0x%X,exception_addr:0x%X\n", 
         thread_id, buf_item.code, buf_item.pc);
@@ -492,6 +1054,7 @@ at_call(app_pc instr_addr, app_pc target_addr)
     DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_app_call_t));
 
     thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_app_call_t)) >= -thd_data->buf_end)
         dump_data(drcontext);
     *(buf_app_call_t*)thd_data->buf_ptr = buf_item;
@@ -516,6 +1079,7 @@ at_call_ind(app_pc instr_addr, app_pc target_addr)
     DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_app_call_t));
 
     thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_app_call_t)) >= -thd_data->buf_end)
         dump_data(drcontext);
     *(buf_app_call_t*)thd_data->buf_ptr = buf_item;
@@ -537,6 +1101,7 @@ at_return(app_pc instr_addr, app_pc target_addr)
     DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_app_ret_t));
 
     thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_app_ret_t)) >= -thd_data->buf_end)
         dump_data(drcontext);
     *(buf_app_ret_t*)thd_data->buf_ptr = buf_item;
@@ -549,12 +1114,7 @@ is_dynamic_code(app_pc pc) {
   if (rng_dynamic_codes.start != 0 &&
     pc >= (app_pc)rng_dynamic_codes.start &&
     pc < (app_pc)rng_dynamic_codes.end) {
-  for (size_t i = 0; i < vec_dynamic_codes.entries; ++i) {
-    range_t *range = drvector_get_entry(&vec_dynamic_codes, i);
-    if (pc >= (app_pc)range->start && pc < (app_pc)range->end) {
-      return true;
-    }
-  }
+    return rangetree_contains(&tree_dynamic_codes, pc);
   }
   return false;
 }
@@ -563,197 +1123,28 @@ static bool
 is_from_exe(app_pc pc, bool lookup)
 {
     bool from_exe = false;
-    module_data_t *mod;
 
     if (pc) {
         if (pc >= app_exe->start && pc < app_exe->end) {
             from_exe = true;
         } else if (lookup) {
-            mod = dr_lookup_module(pc);   // FIXME: Time consuming!
-            if (mod) {
-                from_exe = mod->start == app_exe->start;
-                dr_free_module_data(mod);
-            }
+            /* binary search over the loaded modules, nothing allocated */
+            modules_lookup(pc, NULL, &from_exe);
         }
     }
 
     return from_exe;
 }
 
-static void
-instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
-               opnd_t ref, bool write)
-{
-    instr_t *instr, *call, *restore;
-    opnd_t opnd1, opnd2;
-    app_pc pc;
-    reg_t reg2 = DR_REG_XCX, reg1 = DR_REG_NULL;
-    static const reg_id_t allowed[5] = { DR_REG_XDX, DR_REG_XBX, DR_REG_XAX, DR_REG_XSI, DR_REG_XDI };
-    app_pc code_cache;
-
-    code_cache = codecache_get();
-
-    /* Store pc in memory ref */
-    pc = instr_get_app_pc(where);
-
-    for (int i = 0; i < 5; i++) {
-        if (!opnd_uses_reg(ref, allowed[i])) {
-            reg1 = allowed[i];
-            break;
-        }
-    }
-
-    DR_ASSERT(reg1 != DR_REG_NULL);
-
-    call  = INSTR_CREATE_label(drcontext);
-    restore = INSTR_CREATE_label(drcontext);
-
-    dr_save_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
-    dr_save_reg(drcontext, ilist, where, reg2, SPILL_SLOT_3);
-
-    /* use drutil to get mem address */
-    drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg1, reg2);
-
-#if 0
-    /* Load g_memtrace_active into ecx */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = OPND_CREATE_MEMPTR(DR_REG_NULL, &g_memtrace_active);
-    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* jecxz restore */
-    opnd1 = opnd_create_instr(restore);
-    instr = INSTR_CREATE_jecxz(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
-#endif
-
-    /* The following assembly performs the following instructions
-     * buf_ptr->code = write;
-     * buf_ptr->addr  = addr;
-     * buf_ptr->size  = size;
-     * buf_ptr->pc    = pc;
-     * buf_ptr++;
-     * if (buf_ptr >= buf_end_ptr)
-     *    clean_call();
-     */
-
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg2);
-
-    /* Load data->buf_ptr into reg2 */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = OPND_CREATE_MEMPTR(reg2, offsetof(per_thread_t, buf_ptr));
-    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Move write/read to write field */
-    opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, kind));
-    opnd2 = OPND_CREATE_INT32(write ? KIND_WRITE : KIND_READ);
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Store address in memory ref */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, addr));
-    opnd2 = opnd_create_reg(reg1);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Store size in memory ref */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, size));
-    /* drutil_opnd_mem_size_in_bytes handles OP_enter */
-    opnd2 = OPND_CREATE_INT32(drutil_opnd_mem_size_in_bytes(ref, where));
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* For 64-bit, we can't use a 64-bit immediate so we split pc into two halves.
-     * We could alternatively load it into reg1 and then store reg1.
-     * We use a convenience routine that does the two-step store for us.
-     */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, pc));
-    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t) pc, opnd1,
-                                     ilist, where, NULL, NULL);
-
-    /* Increment reg value by pointer size using lea instr */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg2, DR_REG_NULL, 0,
-                                  sizeof(mem_ref_t),
-                                  OPSZ_lea);
-    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Update the data->buf_ptr */
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg1);
-    opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_ptr));
-    opnd2 = opnd_create_reg(reg2);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* we use lea + jecxz trick for better performance
-     * lea and jecxz won't disturb the eflags, so we won't insert
-     * code to save and restore application's eflags.
-     */
-    /* lea [reg2 + -buf_end] => reg2 */
-    opnd1 = opnd_create_reg(reg1);
-    opnd2 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_end));
-    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg1, reg2, 1, 0, OPSZ_lea);
-    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* jecxz call */
-    opnd1 = opnd_create_instr(call);
-    instr = INSTR_CREATE_jecxz(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* jump restore to skip clean call */
-    opnd1 = opnd_create_instr(restore);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* clean call */
-    /* We jump to lean procedure which performs full context switch and
-     * clean call invocation. This is to reduce the code cache size.
-     */
-    instrlist_meta_preinsert(ilist, where, call);
-
-    /* mov restore DR_REG_XCX */
-    opnd1 = opnd_create_reg(reg2);
-    /* this is the return address for jumping back from lean procedure */
-    opnd2 = opnd_create_instr(restore);
-    /* We could use instrlist_insert_mov_instr_addr(), but with a register
-     * destination we know we can use a 64-bit immediate.
-     */
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* jmp code_cache */
-    opnd1 = opnd_create_pc(code_cache);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Restore scratch registers */
-    instrlist_meta_preinsert(ilist, where, restore);
-
-    dr_restore_reg(drcontext, ilist, where, reg2, SPILL_SLOT_3);
-    dr_restore_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
-}
-
-static void
-instrument_bb(void *drcontext, instrlist_t *ilist, instr_t *where, user_data_t *ud)
+/* Length of the last instr with its link kind, as stored in the block record */
+static uint
+bb_last_instr_info(void *drcontext, instrlist_t *ilist, app_pc *last_pc)
 {
-    instr_t *instr, *call, *restore;
-    opnd_t opnd1, opnd2;
-    app_pc pc;
-    reg_t reg2 = DR_REG_XCX, reg1 = DR_REG_XBX;
-    app_pc code_cache;
-
-    if (where != ud->first_instr) return;
-
     instr_t* last_instr = instrlist_last_app(ilist);
-    app_pc last_pc = instr_get_app_pc(last_instr);
     uint len_last_instr = instr_length(drcontext, last_instr);
 
+    *last_pc = instr_get_app_pc(last_instr);
+
     /* https://github.com/DynamoRIO/dynamorio/blob/release_6_2_0/core/arch/x86/instr.c#L292 */
     switch (instr_get_opcode(last_instr)) {
         case OP_call:
@@ -774,116 +1165,134 @@ instrument_bb(void *drcontext, instrlist_t *ilist, instr_t *where, user_data_t *
             len_last_instr |= (LINK_JMP << LINK_SHIFT_FIELD);
     }
 
-    code_cache = codecache_get();
-    pc = instr_get_app_pc(where);
+    return len_last_instr;
+}
 
-    call  = INSTR_CREATE_label(drcontext);
-    restore = INSTR_CREATE_label(drcontext);
+static bool
+opc_is_jcc(uint opc)
+{
+    /* loop and jecxz are left out, they change or test xcx */
+    return (opc >= OP_jo && opc <= OP_jnle) ||
+           (opc >= OP_jo_short && opc <= OP_jnle_short);
+}
 
-    dr_save_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
-    dr_save_reg(drcontext, ilist, where, reg2, SPILL_SLOT_3);
+/* The exe or dynamic code, only inside the ranges with -ranges */
+static bool
+is_traced_code(app_pc pc)
+{
+    return (is_from_exe(pc, true) || is_dynamic_code(pc)) &&
+        (!enable_ranges || rangetree_contains(&tree_selected, pc));
+}
 
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg2);
+/* Descriptor of the block for the .blocks file, with how it hands over
+ * to the next block. A branch leaving the traced code counts as indirect:
+ * the block coming back has to record itself.
+ */
+static void
+bb_describe(void *drcontext, instrlist_t *ilist, buf_block_t *desc)
+{
+    instr_t *last_instr = instrlist_last_app(ilist);
+    app_pc fall, target = NULL;
+
+    memset(desc, 0, sizeof(buf_block_t));
+    desc->pc = instr_get_app_pc(instrlist_first_app(ilist));
+    desc->size = bb_last_instr_info(drcontext, ilist, &desc->last_pc);
+    fall = desc->last_pc + instr_length(drcontext, last_instr);
+
+    if ((instr_is_ubr(last_instr) || instr_is_call_direct(last_instr) ||
+         (instr_is_cbr(last_instr) && opc_is_jcc(instr_get_opcode(last_instr)))) &&
+        opnd_is_pc(instr_get_target(last_instr))) {
+        target = opnd_get_pc(instr_get_target(last_instr));
+        desc->branch = instr_is_cbr(last_instr) ? BRANCH_COND : BRANCH_DIRECT;
+    } else if (!instr_is_cti(last_instr) && !instr_is_syscall(last_instr) &&
+               !instr_is_interrupt(last_instr)) {
+        /* block split without a branch */
+        target = fall;
+        desc->branch = BRANCH_DIRECT;
+    } else {
+        desc->branch = BRANCH_INDIRECT;
+    }
 
-    /* Load data->buf_ptr into reg2 */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = OPND_CREATE_MEMPTR(reg2, offsetof(per_thread_t, buf_ptr));
-    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    if (target && (!is_traced_code(target) ||
+                   (desc->branch == BRANCH_COND && !is_traced_code(fall)))) {
+        desc->branch = BRANCH_INDIRECT;
+        target = NULL;
+    }
+    desc->target = target;
+}
 
-    /* Store kind */
-    opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, kind));
-    opnd2 = OPND_CREATE_INT32(KIND_BB);
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+static void
+instrument_bb_counter(void *drcontext, instrlist_t *ilist, instr_t *where)
+{
+    buf_block_t desc;
+    uint id, *counter;
 
-    /* Store last pc */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, addr));
-    opnd2 = OPND_CREATE_INT32(last_pc);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    bb_describe(drcontext, ilist, &desc);
+    id = blocks_add(&desc, NULL);
+    counter = blocks_counter(id);
 
-    /* Store about last instr */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, size));
-    opnd2 = OPND_CREATE_INT32(len_last_instr);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* table full: the block is still described, just not counted */
+    if (!counter) return;
 
-    /* For 64-bit, we can't use a 64-bit immediate so we split pc into two halves.
-     * We could alternatively load it into reg1 and then store reg1.
-     * We use a convenience routine that does the two-step store for us.
-     */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, pc));
-    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t) pc, opnd1,
-                                     ilist, where, NULL, NULL);
-
-    /* Increment reg value by pointer size using lea instr */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg2, DR_REG_NULL, 0,
-                                  sizeof(mem_ref_t),
-                                  OPSZ_lea);
-    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* locked, the threads running the block share the counter */
+    drx_insert_counter_update(drcontext, ilist, where, SPILL_SLOT_1,
+        counter, 1, DRX_COUNTER_LOCK);
+}
 
-    /* Update the data->buf_ptr */
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg1);
-    opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_ptr));
-    opnd2 = opnd_create_reg(reg2);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+/* Clean call of a block reaching the -demote count: it is built again
+ * counting only, once the threads are out of the code cache.
+ */
+static void
+demote_block(uint id, app_pc pc)
+{
+    if (blocks_demote(id))
+        dr_delay_flush_region(pc, 1, 0, NULL);
+}
 
-    /* we use lea + jecxz trick for better performance
-     * lea and jecxz won't disturb the eflags, so we won't insert
-     * code to save and restore application's eflags.
-     */
-    /* lea [reg2 + -buf_end] => reg2 */
-    opnd1 = opnd_create_reg(reg1);
-    opnd2 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_end));
-    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg1, reg2, 1, 0, OPSZ_lea);
-    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+/* Counter of the block for -demote. Calls and returns keep their records,
+ * the parser needs them for the stacks.
+ */
+static void
+demote_analyze(void *drcontext, instrlist_t *ilist, user_data_t *ud)
+{
+    buf_block_t desc;
 
-    /* jecxz call */
-    opnd1 = opnd_create_instr(call);
-    instr = INSTR_CREATE_jecxz(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
+    bb_describe(drcontext, ilist, &desc);
+    if ((desc.size >> LINK_SHIFT_FIELD) != LINK_JMP) return;
 
-    /* jump restore to skip clean call */
-    opnd1 = opnd_create_instr(restore);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* same descriptor as -compact gives, one id for both */
+    desc.refs = ud->num_slots;
+    ud->block_id = blocks_add(&desc, ud->slots);
+    ud->counter = blocks_counter(ud->block_id);
+    ud->demoted = ud->counter && blocks_demoted(ud->block_id);
+}
 
-    /* clean call */
-    /* We jump to lean procedure which performs full context switch and
-     * clean call invocation. This is to reduce the code cache size.
-     */
-    instrlist_meta_preinsert(ilist, where, call);
+/* counter++; if (counter >= demote_threshold) clean_call demote_block */
+static void
+instrument_demote_check(void *drcontext, instrlist_t *ilist, instr_t *where,
+                        user_data_t *ud)
+{
+    instr_t *skip = INSTR_CREATE_label(drcontext);
+    instr_t *instr;
 
-    /* mov restore DR_REG_XCX */
-    opnd1 = opnd_create_reg(reg2);
-    /* this is the return address for jumping back from lean procedure */
-    opnd2 = opnd_create_instr(restore);
-    /* We could use instrlist_insert_mov_instr_addr(), but with a register
-     * destination we know we can use a 64-bit immediate.
-     */
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    /* locked, a lost update would move the demotion */
+    drx_insert_counter_update(drcontext, ilist, where, SPILL_SLOT_1,
+        ud->counter, 1, DRX_COUNTER_LOCK);
 
-    /* jmp code_cache */
-    opnd1 = opnd_create_pc(code_cache);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
+    if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    instr = INSTR_CREATE_cmp(drcontext,
+        OPND_CREATE_ABSMEM((void *)ud->counter, OPSZ_4),
+        OPND_CREATE_INT32(demote_threshold));
     instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Restore scratch registers */
-    instrlist_meta_preinsert(ilist, where, restore);
-
-    dr_restore_reg(drcontext, ilist, where, reg2, SPILL_SLOT_3);
-    dr_restore_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
-
-    // instrlist_disassemble(drcontext, tag, bb, STDERR);
+    instr = INSTR_CREATE_jcc(drcontext, OP_jb, opnd_create_instr(skip));
+    instrlist_meta_preinsert(ilist, where, instr);
+    dr_insert_clean_call(drcontext, ilist, where, (void *)demote_block, false, 2,
+        OPND_CREATE_INT32(ud->block_id), OPND_CREATE_INTPTR(instr_get_app_pc(where)));
+    instrlist_meta_preinsert(ilist, where, skip);
+    drreg_unreserve_aflags(drcontext, ilist, where);
 }
 
 static bool
@@ -894,182 +1303,735 @@ opc_is_stringop_loop(uint opc)
             opc == OP_repne_cmps || opc == OP_rep_scas || opc == OP_repne_scas);
 }
 
+/* Walks the block in the order event_bb_insert emits the memtrace records,
+ * fills slots when given, returns the number of records.
+ */
+static uint
+bb_collect_slots(void *drcontext, instrlist_t *ilist, mem_ref_t *slots)
+{
+    instr_t *instr, *next;
+    app_pc loop_pc = NULL, loop_stop_pc = NULL;
+    opnd_t ref;
+    uint num = 0;
+    int i;
+
+    for (instr = instrlist_first_app(ilist); instr; instr = instr_get_next_app(instr)) {
+        app_pc pc = instr_get_app_pc(instr);
+
+        if (loop_stop_pc && loop_stop_pc == pc) {
+            if (slots) {
+                slots[num].kind = KIND_LOOP;
+                slots[num].addr = 0;
+                slots[num].size = 0;
+                slots[num].pc = loop_pc;
+            }
+            num++;
+            loop_stop_pc = NULL;
+        }
+        if (opc_is_stringop_loop(instr_get_opcode(instr))) {
+            /* the stop is only seen when the rep is not the last instr */
+            next = instr_get_next_app(instr);
+            if (next) {
+                loop_pc = pc;
+                loop_stop_pc = instr_get_app_pc(next);
+            }
+        }
+
+        if (instr_reads_memory(instr)) {
+            for (i = 0; i < instr_num_srcs(instr); i++) {
+                ref = instr_get_src(instr, i);
+                if (!opnd_is_memory_reference(ref)) continue;
+                if (slots) {
+                    slots[num].kind = KIND_READ;
+                    slots[num].addr = 0;
+                    slots[num].size = drutil_opnd_mem_size_in_bytes(ref, instr);
+                    slots[num].pc = pc;
+                }
+                num++;
+            }
+        }
+        if (instr_writes_memory(instr)) {
+            for (i = 0; i < instr_num_dsts(instr); i++) {
+                ref = instr_get_dst(instr, i);
+                if (!opnd_is_memory_reference(ref)) continue;
+                if (slots) {
+                    slots[num].kind = KIND_WRITE;
+                    slots[num].addr = 0;
+                    slots[num].size = drutil_opnd_mem_size_in_bytes(ref, instr);
+                    slots[num].pc = pc;
+                }
+                num++;
+            }
+        }
+    }
+
+    return num;
+}
+
+/* Sizes the records of the block so its entry can reserve them at once,
+ * and looks for a register no app instr touches to hold the pointer.
+ */
 static void
-instrument_stringop_loop(void *drcontext, instrlist_t *ilist, instr_t *where)
+analyze_bb(void *drcontext, instrlist_t *ilist, user_data_t *ud)
 {
+    static const reg_id_t hold_regs[] = {
+        DR_REG_XDI, DR_REG_XSI, DR_REG_XBX, DR_REG_XDX, DR_REG_XAX, DR_REG_XCX, DR_REG_XBP
+    };
     instr_t *instr;
-    opnd_t opnd1, opnd2;
-    app_pc pc;
-    reg_t reg2 = DR_REG_XCX, reg1 = DR_REG_XBX;
-    pc = instr_get_app_pc(where);
+    uint slot, off;
+
+    ud->record_size = enable_compact ? sizeof(uint) : sizeof(mem_ref_t);
+    ud->num_slots = 0;
+    ud->slots = NULL;
+    ud->slot_offs = NULL;
+
+    if (enable_memtrace)
+        ud->num_slots = bb_collect_slots(drcontext, ilist, NULL);
+    if (ud->num_slots) {
+        ud->slots = dr_thread_alloc(drcontext, ud->num_slots * sizeof(mem_ref_t));
+        ud->slot_offs = dr_thread_alloc(drcontext, ud->num_slots * sizeof(uint));
+        bb_collect_slots(drcontext, ilist, ud->slots);
+    }
 
-    dr_save_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
+    /* compact: the slots live in the .blocks file, the trace keeps only
+     * the address (and the final counter of a loop) after the block id */
+    off = ud->record_size;
+    for (slot = 0; slot < ud->num_slots; slot++) {
+        ud->slot_offs[slot] = off;
+        if (!enable_compact)
+            off += sizeof(mem_ref_t);
+        else if (ud->slots[slot].kind == KIND_LOOP)
+            off += 2 * sizeof(uint);
+        else
+            off += sizeof(uint);
+    }
+    ud->total_size = off;
+    DR_ASSERT(ud->total_size + sizeof(buf_repeat_t) + sizeof(buf_time_t) < BUF_MIN_SIZE);
 
-    /* read *data ptr into reg1 xbx */
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg1);
+    ud->hold_reg = DR_REG_NULL;
+    if (ud->num_slots == 0) return;
 
-    /* Store reg2 xcx into data->loop_xcx into reg2 */
-    opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, loop_xcx));
-    opnd2 = opnd_create_reg(reg2);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+    for (int i = 0; i < sizeof(hold_regs)/sizeof(*hold_regs); i++) {
+        for (instr = instrlist_first_app(ilist); instr; instr = instr_get_next_app(instr)) {
+            if (instr_uses_reg(instr, hold_regs[i])) break;
+        }
+        if (!instr) {
+            ud->hold_reg = hold_regs[i];
+            break;
+        }
+    }
+}
+
+static void
+insert_store_imm(void *drcontext, instrlist_t *ilist, instr_t *where,
+                 reg_id_t base, int disp, int value)
+{
+    instr_t *instr;
+
+    instr = INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM32(base, disp),
+                                OPND_CREATE_INT32(value));
     instrlist_meta_preinsert(ilist, where, instr);
+}
 
-    /* For 64-bit, we can't use a 64-bit immediate so we split pc into two halves.
-     * We could alternatively load it into reg1 and then store reg1.
-     * We use a convenience routine that does the two-step store for us.
-     */
-    opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, loop_pc));
-    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t) pc, opnd1,
-                                     ilist, where, NULL, NULL);
+/* Displacement of a slot field from the end of the block records */
+static int
+slot_disp(user_data_t *ud, uint slot, uint field)
+{
+    if (enable_compact)
+        field = field == offsetof(mem_ref_t, addr) ? 0 : sizeof(uint);
+    return (int)(ud->slot_offs[slot] + field) - (int)ud->total_size;
+}
 
-    /* Restore scratch registers */
-    dr_restore_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
+/* Register pointing to the end of the block records: the held one, or
+ * reg reloaded from data->buf_ptr which was advanced at block entry.
+ */
+static reg_id_t
+insert_records_end(void *drcontext, instrlist_t *ilist, instr_t *where,
+                   user_data_t *ud, reg_id_t reg)
+{
+    instr_t *instr;
 
-    // instrlist_disassemble(drcontext, tag, bb, STDERR);
+    if (ud->reg_ptr != DR_REG_NULL) return ud->reg_ptr;
+
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg);
+    instr = INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg),
+                                OPND_CREATE_MEMPTR(reg, offsetof(per_thread_t, buf_ptr)));
+    instrlist_meta_preinsert(ilist, where, instr);
+    return reg;
+}
+
+/* Let go of the held pointer once the last slot is written */
+static void
+release_records_end(void *drcontext, instrlist_t *ilist, instr_t *where, user_data_t *ud)
+{
+    if (ud->reg_ptr == DR_REG_NULL || ud->next_slot < ud->num_slots) return;
+
+    drreg_unreserve_register(drcontext, ilist, where, ud->reg_ptr);
+    ud->reg_ptr = DR_REG_NULL;
 }
 
 static void
-instrument_stringop_loop_stop(void *drcontext, instrlist_t *ilist, instr_t *where)
+instrument_bb(void *drcontext, instrlist_t *ilist, instr_t *where, user_data_t *ud)
 {
-    instr_t *instr, *call, *restore;
+    instr_t *instr, *reload, *ok, *check, *records, *done;
     opnd_t opnd1, opnd2;
-    reg_t reg2 = DR_REG_XCX, reg1 = DR_REG_XBX, reg3 = DR_REG_XDX;
-    app_pc code_cache;
+    app_pc pc, last_pc;
+    reg_id_t reg_ptr, reg_tmp;
+    drvector_t allowed;
+    uint len_last_instr;
+    uint total = ud->total_size;
+    uint slot, off, id = 0, tag;
+    bool repeatable, linked;
 
-    code_cache = codecache_get();
-    call  = INSTR_CREATE_label(drcontext);
-    restore = INSTR_CREATE_label(drcontext);
+    if (where != ud->first_instr) return;
 
-    dr_save_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
-    dr_save_reg(drcontext, ilist, where, reg2, SPILL_SLOT_3);
-    dr_save_reg(drcontext, ilist, where, reg3, SPILL_SLOT_4);
+    len_last_instr = bb_last_instr_info(drcontext, ilist, &last_pc);
+    pc = instr_get_app_pc(where);
 
-    /* Save ecx register to ebx */
-    opnd1 = opnd_create_reg(reg1);
-    opnd2 = opnd_create_reg(reg2);
-    instr = XINST_CREATE_move(drcontext, opnd1, opnd2);
-    instrlist_meta_preinsert(ilist, where, instr);
+    if (enable_compact) {
+        /* The descriptor goes to the .blocks file once, here only the id */
+        buf_block_t desc;
 
-    /* Load per_thread into reg2 ecx */
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg2);
+        bb_describe(drcontext, ilist, &desc);
+        desc.refs = ud->num_slots;
+        id = blocks_add(&desc, ud->slots);
+    }
 
-    /* Save reg2 ecx register into reg3 edx */
-    opnd1 = opnd_create_reg(reg3);
-    opnd2 = opnd_create_reg(reg2);
-    instr = XINST_CREATE_move(drcontext, opnd1, opnd2);
+    /* A block running again right after its own record only bumps the
+     * repeat counter: jumps without memory refs, calls and returns are
+     * kept apart for the stack of the parser.
+     */
+    linked = (len_last_instr >> LINK_SHIFT_FIELD) != LINK_JMP;
+    if (trace_mode == TRACE_MODE_CALLS && enable_ranges && !linked) {
+        /* a jump out of the ranges: the block coming back records itself */
+        buf_block_t desc;
+
+        bb_describe(drcontext, ilist, &desc);
+        linked = desc.branch == BRANCH_INDIRECT;
+    }
+    repeatable = ud->num_slots == 0 && !linked && trace_mode != TRACE_MODE_CALLS;
+    tag = enable_compact ? (KIND_BB_ID | id) : (uint)pc;
+
+    ud->reg_ptr = DR_REG_NULL;
+    ud->next_slot = 0;
+
+    if (ud->hold_reg != DR_REG_NULL) {
+        drreg_init_and_fill_vector(&allowed, false);
+        drreg_set_vector_entry(&allowed, ud->hold_reg, true);
+        if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_ptr) == DRREG_SUCCESS)
+            ud->reg_ptr = reg_ptr;
+        drvector_delete(&allowed);
+    }
+    if (ud->reg_ptr == DR_REG_NULL &&
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS ||
+        drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+
+    reload = INSTR_CREATE_label(drcontext);
+    ok = INSTR_CREATE_label(drcontext);
+    check = INSTR_CREATE_label(drcontext);
+    records = INSTR_CREATE_label(drcontext);
+    done = INSTR_CREATE_label(drcontext);
+
+    /* The following assembly reserves the records of the whole block
+     * if (calls mode && !linked && !link_pending)
+     *    done;
+     * reg_ptr = buf_ptr;
+     * if (repeatable && reg_ptr == repeat_end && repeat_tag == tag)
+     *    repeat_count++, done;
+     * if (buf_ptr + repeat + total > buf_end_ptr)
+     *    clean_call(), reg_ptr = buf_ptr;
+     * if (repeat_count)
+     *    write the repeat record, repeat_count = 0;
+     * write the block record and the static part of memory refs
+     * buf_ptr = reg_ptr + total;
+     */
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+
+    if (trace_mode == TRACE_MODE_CALLS && !linked) {
+        /* calls mode: a jump block only records right after a call or return */
+        opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, link_pending));
+        opnd2 = OPND_CREATE_INT32(0);
+        instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+        instr = INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(done));
+        instrlist_meta_preinsert(ilist, where, instr);
+    }
+
+    /* Load data->buf_ptr into reg_ptr */
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_ptr));
+    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Load data->buf_ptr into reg2 */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = OPND_CREATE_MEMPTR(reg2, offsetof(per_thread_t, buf_ptr));
+    if (repeatable) {
+        /* nothing was written since our own record */
+        opnd1 = opnd_create_reg(reg_ptr);
+        opnd2 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, repeat_end));
+        instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+        instr = INSTR_CREATE_jcc(drcontext, OP_jne, opnd_create_instr(check));
+        instrlist_meta_preinsert(ilist, where, instr);
+
+        opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, repeat_tag));
+        opnd2 = OPND_CREATE_INT32(tag);
+        instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+        instr = INSTR_CREATE_jcc(drcontext, OP_jne, opnd_create_instr(check));
+        instrlist_meta_preinsert(ilist, where, instr);
+
+        opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, repeat_count));
+        instr = INSTR_CREATE_inc(drcontext, opnd1);
+        instrlist_meta_preinsert(ilist, where, instr);
+        instr = INSTR_CREATE_jmp(drcontext, opnd_create_instr(done));
+        instrlist_meta_preinsert(ilist, where, instr);
+
+        instrlist_meta_preinsert(ilist, where, check);
+    }
+
+    /* lea [-buf_end + reg_ptr + total] => reg_tmp, positive when not fit,
+     * with room for the repeat record of the previous block */
+    opnd1 = opnd_create_reg(reg_tmp);
+    opnd2 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_end));
     instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = opnd_create_reg(reg_tmp);
+    opnd2 = opnd_create_base_disp(reg_tmp, reg_ptr, 1, total + sizeof(buf_repeat_t), OPSZ_lea);
+    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    opnd1 = opnd_create_reg(reg_tmp);
+    instr = INSTR_CREATE_test(drcontext, opnd1, opnd1);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    /* jle ok */
+    instr = INSTR_CREATE_jcc(drcontext, OP_jle, opnd_create_instr(ok));
+    instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Set kind */
-    opnd1 = OPND_CREATE_MEM32(reg2, offsetof(mem_ref_t, kind));
-    opnd2 = OPND_CREATE_INT32(KIND_LOOP);
+    /* clean call */
+    /* We jump to lean procedure which performs full context switch and
+     * clean call invocation. This is to reduce the code cache size.
+     */
+    /* this is the return address for jumping back from lean procedure */
+    opnd1 = opnd_create_reg(reg_tmp);
+    opnd2 = opnd_create_instr(reload);
     instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Store counter reg 1 xbx in memory ref's size */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, size));
-    opnd2 = opnd_create_reg(reg1);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+    /* jmp code_cache, the one returning through reg_tmp */
+    opnd1 = opnd_create_pc(codecache_get(reg_tmp));
+    instr = INSTR_CREATE_jmp(drcontext, opnd1);
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Load loop_xcx into reg 1 xbx */
-    opnd1 = opnd_create_reg(reg1);
-    opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, loop_xcx));
+    /* the buffer was flushed, start over from its base */
+    instrlist_meta_preinsert(ilist, where, reload);
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_ptr);
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = OPND_CREATE_MEMPTR(reg_ptr, offsetof(per_thread_t, buf_ptr));
     instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Store latest xcx value into memory ref's address */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, addr));
-    opnd2 = opnd_create_reg(reg1);
-    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, ok);
+
+    /* the repeats of the previous block go before our record */
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+    opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, repeat_count));
+    opnd2 = OPND_CREATE_INT32(0);
+    instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(records));
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Load loop_pc into reg 1 xbx */
-    opnd1 = opnd_create_reg(reg1);
-    opnd2 = OPND_CREATE_MEMPTR(reg3, offsetof(per_thread_t, loop_pc));
+    opnd1 = opnd_create_reg(reg_tmp);
+    opnd2 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, repeat_count));
     instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
-
-    /* Store loop pc into memory ref's pc */
-    opnd1 = OPND_CREATE_MEMPTR(reg2, offsetof(mem_ref_t, pc));
-    opnd2 = opnd_create_reg(reg1);
+    insert_store_imm(drcontext, ilist, where, reg_ptr,
+                     offsetof(buf_repeat_t, kind), KIND_REPEAT);
+    opnd1 = OPND_CREATE_MEM32(reg_ptr, offsetof(buf_repeat_t, count));
+    opnd2 = opnd_create_reg(reg_tmp);
     instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = opnd_create_base_disp(reg_ptr, DR_REG_NULL, 0, sizeof(buf_repeat_t), OPSZ_lea);
+    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+    insert_store_imm(drcontext, ilist, where, reg_tmp,
+                     offsetof(per_thread_t, repeat_count), 0);
+
+    instrlist_meta_preinsert(ilist, where, records);
+
+    if (enable_compact) {
+        insert_store_imm(drcontext, ilist, where, reg_ptr, 0, KIND_BB_ID | id);
+    } else {
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         offsetof(mem_ref_t, kind), KIND_BB);
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         offsetof(mem_ref_t, addr), (int)last_pc);
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         offsetof(mem_ref_t, size), len_last_instr);
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         offsetof(mem_ref_t, pc), (int)pc);
+    }
+
+    /* Memory refs are complete but for the address, which is stored by
+     * the instr itself; should the block not run to the end the records
+     * still parse. Compact slots are sized by the block id alone.
+     */
+    for (slot = 0; slot < ud->num_slots && !enable_compact; slot++) {
+        off = ud->slot_offs[slot];
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         off + offsetof(mem_ref_t, kind), ud->slots[slot].kind);
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         off + offsetof(mem_ref_t, addr), 0);
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         off + offsetof(mem_ref_t, size), ud->slots[slot].size);
+        insert_store_imm(drcontext, ilist, where, reg_ptr,
+                         off + offsetof(mem_ref_t, pc), (int)ud->slots[slot].pc);
+    }
 
-    /* Increment reg value by pointer size using lea instr */
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg2, DR_REG_NULL, 0,
-                                  sizeof(mem_ref_t),
-                                  OPSZ_lea);
+    /* Increment reg_ptr by the block records using lea instr */
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = opnd_create_base_disp(reg_ptr, DR_REG_NULL, 0, total, OPSZ_lea);
     instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
     /* Update the data->buf_ptr */
-    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg1);
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+    opnd1 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_ptr));
+    opnd2 = opnd_create_reg(reg_ptr);
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    if (repeatable) {
+        opnd1 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, repeat_end));
+        opnd2 = opnd_create_reg(reg_ptr);
+        instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+        insert_store_imm(drcontext, ilist, where, reg_tmp,
+                         offsetof(per_thread_t, repeat_tag), tag);
+    }
+
+    if (trace_mode == TRACE_MODE_CALLS) {
+        insert_store_imm(drcontext, ilist, where, reg_tmp,
+                         offsetof(per_thread_t, link_pending), linked ? 1 : 0);
+    }
+
+    instrlist_meta_preinsert(ilist, where, done);
 
-    opnd1 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_ptr));
-    opnd2 = opnd_create_reg(reg2);
+    drreg_unreserve_aflags(drcontext, ilist, where);
+    drreg_unreserve_register(drcontext, ilist, where, reg_tmp);
+    if (ud->reg_ptr == DR_REG_NULL)
+        drreg_unreserve_register(drcontext, ilist, where, reg_ptr);
+    release_records_end(drcontext, ilist, where, ud);
+
+    // instrlist_disassemble(drcontext, tag, bb, STDERR);
+}
+
+static void
+instrument_mem(void *drcontext, instrlist_t *ilist, instr_t *where,
+               opnd_t ref, bool write, user_data_t *ud)
+{
+    instr_t *instr;
+    opnd_t opnd1, opnd2;
+    reg_id_t reg_addr, reg_tmp, reg_end, reg;
+    drvector_t allowed;
+    uint slot = ud->next_slot++;
+
+    DR_ASSERT(slot < ud->num_slots);
+    DR_ASSERT(ud->slots[slot].kind == (write ? KIND_WRITE : KIND_READ));
+
+    /* scratch registers must not be part of the address */
+    drreg_init_and_fill_vector(&allowed, true);
+    for (reg = DR_REG_XAX; reg <= DR_REG_XDI; reg++) {
+        if (opnd_uses_reg(ref, reg))
+            drreg_set_vector_entry(&allowed, reg, false);
+    }
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_addr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_tmp) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        drvector_delete(&allowed);
+        return;
+    }
+    drvector_delete(&allowed);
+
+    /* base and index may still carry a value of ours from a previous instr */
+    if (opnd_is_base_disp(ref)) {
+        reg = opnd_get_base(ref);
+        if (reg_is_gpr(reg) && reg_is_pointer_sized(reg) && reg != DR_REG_XSP)
+            drreg_get_app_value(drcontext, ilist, where, reg, reg);
+        reg = opnd_get_index(ref);
+        if (reg_is_gpr(reg) && reg_is_pointer_sized(reg) && reg != DR_REG_XSP)
+            drreg_get_app_value(drcontext, ilist, where, reg, reg);
+    }
+
+    /* use drutil to get mem address */
+    drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg_addr, reg_tmp);
+
+    /* Store address in memory ref */
+    reg_end = insert_records_end(drcontext, ilist, where, ud, reg_tmp);
+    opnd1 = OPND_CREATE_MEMPTR(reg_end, slot_disp(ud, slot, offsetof(mem_ref_t, addr)));
+    opnd2 = opnd_create_reg(reg_addr);
     instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* we use lea + jecxz trick for better performance
-     * lea and jecxz won't disturb the eflags, so we won't insert
-     * code to save and restore application's eflags.
+    drreg_unreserve_register(drcontext, ilist, where, reg_tmp);
+    drreg_unreserve_register(drcontext, ilist, where, reg_addr);
+    release_records_end(drcontext, ilist, where, ud);
+}
+
+/* Store the app xcx into a field of the loop record: the counter before
+ * the rep instr goes to addr, the one left at the following instr to size.
+ */
+static void
+instrument_stringop_loop(void *drcontext, instrlist_t *ilist, instr_t *where,
+                         user_data_t *ud, uint slot, uint field)
+{
+    instr_t *instr;
+    opnd_t opnd1, opnd2;
+    reg_id_t reg_xcx, reg_tmp, reg_end;
+    drvector_t allowed;
+
+    DR_ASSERT(slot < ud->num_slots && ud->slots[slot].kind == KIND_LOOP);
+
+    drreg_init_and_fill_vector(&allowed, true);
+    drreg_set_vector_entry(&allowed, DR_REG_XCX, false);
+    if (drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_xcx) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, &allowed, &reg_tmp) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        drvector_delete(&allowed);
+        return;
+    }
+    drvector_delete(&allowed);
+
+    drreg_get_app_value(drcontext, ilist, where, DR_REG_XCX, reg_xcx);
+
+    reg_end = insert_records_end(drcontext, ilist, where, ud, reg_tmp);
+    opnd1 = OPND_CREATE_MEMPTR(reg_end, slot_disp(ud, slot, field));
+    opnd2 = opnd_create_reg(reg_xcx);
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    drreg_unreserve_register(drcontext, ilist, where, reg_tmp);
+    drreg_unreserve_register(drcontext, ilist, where, reg_xcx);
+}
+
+/* Branch mode, block entry: record the block when nothing statically
+ * leads to it, the taken bits so far go first.
+ */
+static void
+instrument_branch_entry(void *drcontext, instrlist_t *ilist, instr_t *where, user_data_t *ud)
+{
+    instr_t *instr, *reload, *ok, *target, *done;
+    opnd_t opnd1, opnd2;
+    reg_id_t reg_ptr, reg_tmp, reg_val;
+    buf_block_t desc;
+    uint total = sizeof(buf_tnt_t) + sizeof(buf_target_t);
+    uint i;
+
+    bb_describe(drcontext, ilist, &desc);
+    blocks_add(&desc, NULL);
+    ud->branch = desc.branch;
+
+    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_val) != DRREG_SUCCESS ||
+        drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+
+    reload = INSTR_CREATE_label(drcontext);
+    ok = INSTR_CREATE_label(drcontext);
+    target = INSTR_CREATE_label(drcontext);
+    done = INSTR_CREATE_label(drcontext);
+
+    /* if (want_target) {
+     *    reg_ptr = buf_ptr, clean_call() while it does not fit;
+     *    if (tnt_count)
+     *       write the taken bits, tnt_count = 0;
+     *    write the target record, buf_ptr = reg_ptr, want_target = 0;
+     * }
      */
-    /* lea [reg2 + -buf_end] => reg2 */
-    opnd1 = opnd_create_reg(reg1);
-    opnd2 = OPND_CREATE_MEMPTR(reg1, offsetof(per_thread_t, buf_end));
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+    opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, want_target));
+    instr = INSTR_CREATE_cmp(drcontext, opnd1, OPND_CREATE_INT32(0));
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(done));
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    instrlist_meta_preinsert(ilist, where, reload);
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_ptr));
+    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = opnd_create_reg(reg_tmp);
+    opnd2 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_end));
     instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
-    opnd1 = opnd_create_reg(reg2);
-    opnd2 = opnd_create_base_disp(reg1, reg2, 1, 0, OPSZ_lea);
+    opnd1 = opnd_create_reg(reg_tmp);
+    opnd2 = opnd_create_base_disp(reg_tmp, reg_ptr, 1, total, OPSZ_lea);
     instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
     instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = opnd_create_reg(reg_tmp);
+    instr = INSTR_CREATE_test(drcontext, opnd1, opnd1);
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jcc(drcontext, OP_jle, opnd_create_instr(ok));
+    instrlist_meta_preinsert(ilist, where, instr);
 
-    /* jecxz call */
-    opnd1 = opnd_create_instr(call);
-    instr = INSTR_CREATE_jecxz(drcontext, opnd1);
+    /* flush through the lean procedure and check again */
+    opnd1 = opnd_create_reg(reg_tmp);
+    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd_create_instr(reload));
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jmp(drcontext, opnd_create_pc(codecache_get(reg_tmp)));
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* jump restore to skip clean call */
-    opnd1 = opnd_create_instr(restore);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
+    instrlist_meta_preinsert(ilist, where, ok);
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+    opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, tnt_count));
+    instr = INSTR_CREATE_cmp(drcontext, opnd1, OPND_CREATE_INT32(0));
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(target));
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* clean call */
-    /* We jump to lean procedure which performs full context switch and
-     * clean call invocation. This is to reduce the code cache size.
-     */
-    instrlist_meta_preinsert(ilist, where, call);
+    insert_store_imm(drcontext, ilist, where, reg_ptr,
+                     offsetof(buf_tnt_t, kind), KIND_TNT);
+    opnd1 = opnd_create_reg(reg_val);
+    opnd2 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, tnt_count));
+    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = OPND_CREATE_MEM32(reg_ptr, offsetof(buf_tnt_t, count));
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd_create_reg(reg_val));
+    instrlist_meta_preinsert(ilist, where, instr);
+    insert_store_imm(drcontext, ilist, where, reg_tmp,
+                     offsetof(per_thread_t, tnt_count), 0);
+    for (i = 0; i < TNT_BITS / 32; i++) {
+        opnd1 = opnd_create_reg(reg_val);
+        opnd2 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, tnt_bits) + i * sizeof(uint));
+        instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+        instrlist_meta_preinsert(ilist, where, instr);
+        opnd1 = OPND_CREATE_MEM32(reg_ptr, offsetof(buf_tnt_t, bits) + i * sizeof(uint));
+        instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd_create_reg(reg_val));
+        instrlist_meta_preinsert(ilist, where, instr);
+        insert_store_imm(drcontext, ilist, where, reg_tmp,
+                         offsetof(per_thread_t, tnt_bits) + i * sizeof(uint), 0);
+    }
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = opnd_create_base_disp(reg_ptr, DR_REG_NULL, 0, sizeof(buf_tnt_t), OPSZ_lea);
+    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
 
-    /* mov restore DR_REG_XCX */
-    opnd1 = opnd_create_reg(reg2);
-    /* this is the return address for jumping back from lean procedure */
-    opnd2 = opnd_create_instr(restore);
-    /* We could use instrlist_insert_mov_instr_addr(), but with a register
-     * destination we know we can use a 64-bit immediate.
+    instrlist_meta_preinsert(ilist, where, target);
+    insert_store_imm(drcontext, ilist, where, reg_ptr,
+                     offsetof(buf_target_t, kind), KIND_TARGET);
+    insert_store_imm(drcontext, ilist, where, reg_ptr,
+                     offsetof(buf_target_t, pc), (int)desc.pc);
+    opnd1 = opnd_create_reg(reg_ptr);
+    opnd2 = opnd_create_base_disp(reg_ptr, DR_REG_NULL, 0, sizeof(buf_target_t), OPSZ_lea);
+    instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = OPND_CREATE_MEMPTR(reg_tmp, offsetof(per_thread_t, buf_ptr));
+    instr = INSTR_CREATE_mov_st(drcontext, opnd1, opnd_create_reg(reg_ptr));
+    instrlist_meta_preinsert(ilist, where, instr);
+    insert_store_imm(drcontext, ilist, where, reg_tmp,
+                     offsetof(per_thread_t, want_target), 0);
+
+    instrlist_meta_preinsert(ilist, where, done);
+
+    drreg_unreserve_aflags(drcontext, ilist, where);
+    drreg_unreserve_register(drcontext, ilist, where, reg_val);
+    drreg_unreserve_register(drcontext, ilist, where, reg_tmp);
+    drreg_unreserve_register(drcontext, ilist, where, reg_ptr);
+}
+
+/* Branch mode, last instr: a jcc shifts in its outcome, an indirect
+ * branch has the next block record itself.
+ */
+static void
+instrument_branch_exit(void *drcontext, instrlist_t *ilist, instr_t *where, user_data_t *ud)
+{
+    instr_t *instr, *taken, *count, *done;
+    opnd_t opnd1, opnd2;
+    reg_id_t reg_tmp, reg_val;
+    uint opc = instr_get_opcode(where);
+
+    if (ud->branch == BRANCH_DIRECT) return;
+
+    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    drmgr_insert_read_tls_field(drcontext, tls_index, ilist, where, reg_tmp);
+
+    if (ud->branch == BRANCH_INDIRECT) {
+        insert_store_imm(drcontext, ilist, where, reg_tmp,
+                         offsetof(per_thread_t, want_target), 1);
+        drreg_unreserve_register(drcontext, ilist, where, reg_tmp);
+        return;
+    }
+
+    /* the entry check and the trigger countdown may have changed the flags,
+     * drreg only brings back those of the app before the jcc itself */
+    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_val) != DRREG_SUCCESS ||
+        drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS ||
+        drreg_restore_app_aflags(drcontext, ilist, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+
+    taken = INSTR_CREATE_label(drcontext);
+    count = INSTR_CREATE_label(drcontext);
+    done = INSTR_CREATE_label(drcontext);
+
+    /* if (jcc) bts tnt_bits, tnt_count;
+     * if (++tnt_count == TNT_BITS) clean_call();
      */
-    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd2);
+    if (opc >= OP_jo_short && opc <= OP_jnle_short)
+        opc = opc - OP_jo_short + OP_jo;
+    instr = INSTR_CREATE_jcc(drcontext, opc, opnd_create_instr(taken));
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jmp(drcontext, opnd_create_instr(count));
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* jmp code_cache */
-    opnd1 = opnd_create_pc(code_cache);
-    instr = INSTR_CREATE_jmp(drcontext, opnd1);
+    instrlist_meta_preinsert(ilist, where, taken);
+    opnd1 = opnd_create_reg(reg_val);
+    opnd2 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, tnt_count));
+    instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
+    instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, tnt_bits));
+    instr = INSTR_CREATE_bts(drcontext, opnd1, opnd_create_reg(reg_val));
+    instrlist_meta_preinsert(ilist, where, instr);
+
+    instrlist_meta_preinsert(ilist, where, count);
+    opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, tnt_count));
+    instr = INSTR_CREATE_inc(drcontext, opnd1);
+    instrlist_meta_preinsert(ilist, where, instr);
+    opnd1 = OPND_CREATE_MEM32(reg_tmp, offsetof(per_thread_t, tnt_count));
+    instr = INSTR_CREATE_cmp(drcontext, opnd1, OPND_CREATE_INT32(TNT_BITS));
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jcc(drcontext, OP_jne, opnd_create_instr(done));
     instrlist_meta_preinsert(ilist, where, instr);
 
-    /* Restore scratch registers */
-    instrlist_meta_preinsert(ilist, where, restore);
+    /* word full, written out by the lean procedure */
+    opnd1 = opnd_create_reg(reg_tmp);
+    instr = INSTR_CREATE_mov_imm(drcontext, opnd1, opnd_create_instr(done));
+    instrlist_meta_preinsert(ilist, where, instr);
+    instr = INSTR_CREATE_jmp(drcontext, opnd_create_pc(codecache_get(reg_tmp)));
+    instrlist_meta_preinsert(ilist, where, instr);
 
-    dr_restore_reg(drcontext, ilist, where, reg3, SPILL_SLOT_4);
-    dr_restore_reg(drcontext, ilist, where, reg2, SPILL_SLOT_3);
-    dr_restore_reg(drcontext, ilist, where, reg1, SPILL_SLOT_2);
+    instrlist_meta_preinsert(ilist, where, done);
 
-    // instrlist_disassemble(drcontext, tag, bb, STDERR);
+    drreg_unreserve_aflags(drcontext, ilist, where);
+    drreg_unreserve_register(drcontext, ilist, where, reg_val);
+    drreg_unreserve_register(drcontext, ilist, where, reg_tmp);
 }
 
 static dr_emit_flags_t
@@ -1081,13 +2043,14 @@ event_bb_app2app(void *drcontext, void *tag, instrlist_t *bb,
 
     instr_t *first_instr = instrlist_first(bb);
     app_pc pc = instr_get_app_pc(first_instr);
-    module_data_t* mod = dr_lookup_module(pc);
 
-    ud->first_instr = NULL;
-    if (is_from_exe(pc, true) || is_dynamic_code(pc)) {
-        ud->first_instr = first_instr;
+    memset(ud, 0, sizeof(user_data_t));
+    ud->build_ts = __rdtsc();
+    if (is_traced_code(pc)) {
+        ud->in_scope = true;
+        if (trigger_tracing())
+            ud->first_instr = first_instr;
     }
-    ud->loop_stop_pc = (app_pc)0;
 
     *user_data = (void *)ud;
 
@@ -1105,6 +2068,20 @@ static dr_emit_flags_t
 event_bb_instru2instru(void *drcontext, void *tag, instrlist_t *bb, bool for_trace,
                        bool translating, void *user_data)
 {
+    per_thread_t *thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    user_data_t *ud = (user_data_t *)user_data;
+
+    thd_data->stats.blocks++;
+    thd_data->stats.build_ticks += __rdtsc() - ud->build_ts;
+    if (ud->first_instr) {
+        thd_data->stats.traced++;
+        thd_data->stats.mem_refs += ud->next_slot;
+    }
+
+    if (ud->slots) {
+        dr_thread_free(drcontext, ud->slots, ud->num_slots * sizeof(mem_ref_t));
+        dr_thread_free(drcontext, ud->slot_offs, ud->num_slots * sizeof(uint));
+    }
     dr_thread_free(drcontext, user_data, sizeof(user_data_t));
     return DR_EMIT_DEFAULT;
 }
@@ -1114,11 +2091,17 @@ event_bb_analysis(void *drcontext,
     void *tag, instrlist_t *bb, bool for_trace, bool translating, void *user_data)
 {
     per_thread_t *thd_data = drmgr_get_tls_field(drcontext, tls_index);
-    // user_data_t *ud = (user_data_t *)user_data;
+    user_data_t *ud = (user_data_t *)user_data;
 
     if (!for_trace && !translating && !thd_data->dump_mcontext)
         dump_thread_mcontext(drcontext);
 
+    if (ud->first_instr &&
+        (trace_mode == TRACE_MODE_TRACE || trace_mode == TRACE_MODE_CALLS))
+        analyze_bb(drcontext, bb, ud);
+    if (ud->first_instr && demote_threshold && trace_mode == TRACE_MODE_TRACE)
+        demote_analyze(drcontext, bb, ud);
+
 #if 0
     instr_t *first_instr = instrlist_first(bb);
     app_pc pc = instr_get_app_pc(first_instr);
@@ -1141,23 +2124,52 @@ event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
 {
     user_data_t *ud = (user_data_t *)user_data;
 
-    if (ud->first_instr) {
+    trigger_insert(drcontext, bb, instr, ud->in_scope);
+
+    if (ud->first_instr && trace_mode == TRACE_MODE_COVERAGE) {
+        /* no buffer at all, only the inline counter */
+        if (instr == ud->first_instr)
+            instrument_bb_counter(drcontext, bb, instr);
+    } else if (ud->first_instr && trace_mode == TRACE_MODE_BRANCH) {
+        /* the parser follows the descriptors in between */
+        if (instr == ud->first_instr)
+            instrument_branch_entry(drcontext, bb, instr, ud);
+        if (instr == instrlist_last_app(bb))
+            instrument_branch_exit(drcontext, bb, instr, ud);
+    } else if (ud->first_instr && ud->demoted) {
+        /* hot block, only counted from now on */
+        if (instr == ud->first_instr)
+            drx_insert_counter_update(drcontext, bb, instr, SPILL_SLOT_1,
+                ud->counter, 1, DRX_COUNTER_LOCK);
+    } else if (ud->first_instr) {
         uint opc = instr_get_opcode(instr);
         app_pc pc = instr_get_app_pc(instr);
 
 #if WITH_BBTRACE
+        if (ud->counter && instr == ud->first_instr)
+            instrument_demote_check(drcontext, bb, instr, ud);
         instrument_bb(drcontext, bb, instr, ud);
-#endif
 
-        if (enable_memtrace) {
-            if (ud->loop_stop_pc == pc) {
-                instrument_stringop_loop_stop(drcontext, bb, instr);
-                ud->loop_stop_pc = (app_pc)0;
+        /* slots are consumed in the order bb_collect_slots laid them out */
+        if (enable_memtrace && instr_is_app(instr)) {
+            uint slot;
+
+            if (ud->next_slot < ud->num_slots &&
+                ud->slots[ud->next_slot].kind == KIND_LOOP) {
+                slot = ud->next_slot++;
+                instrument_stringop_loop(drcontext, bb, instr, ud, slot,
+                    offsetof(mem_ref_t, size));
+                release_records_end(drcontext, bb, instr, ud);
             }
             if (opc_is_stringop_loop(opc)) {
-                instr_t *next = instr_get_next_app(instr);
-                ud->loop_stop_pc = instr_get_app_pc(next);
-                instrument_stringop_loop(drcontext, bb, instr);
+                for (slot = ud->next_slot; slot < ud->num_slots; slot++) {
+                    if (ud->slots[slot].kind == KIND_LOOP && ud->slots[slot].pc == pc)
+                        break;
+                }
+                /* no slot when the rep ends the block */
+                if (slot < ud->num_slots)
+                    instrument_stringop_loop(drcontext, bb, instr, ud, slot,
+                        offsetof(mem_ref_t, addr));
             }
 
             opnd_t ref;
@@ -1167,7 +2179,7 @@ event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
                 for (i = 0; i < instr_num_srcs(instr); i++) {
                     ref = instr_get_src(instr, i);
                     if (opnd_is_memory_reference(ref)) {
-                        instrument_mem(drcontext, bb, instr, ref, false);
+                        instrument_mem(drcontext, bb, instr, ref, false, ud);
                     }
                 }
             }
@@ -1175,11 +2187,12 @@ event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
                 for (i = 0; i < instr_num_dsts(instr); i++) {
                     ref = instr_get_dst(instr, i);
                     if (opnd_is_memory_reference(ref)) {
-                        instrument_mem(drcontext, bb, instr, ref, true);
+                        instrument_mem(drcontext, bb, instr, ref, true, ud);
                     }
                 }
             }
         }
+#endif
 
 #if WITH_APPCALL
         /* instrument calls and returns -- ignore far calls/rets */
@@ -1212,25 +2225,348 @@ event_bb_insert(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
 }
 
 
-/* clean_call dumps the memory reference info to the log file */
+/* clean_call dumps the memory reference info to the log file, or only
+ * writes out a full word of taken bits */
 static void
 clean_call(void)
 {
     void *drcontext = dr_get_current_drcontext();
-    dump_data(drcontext);
+    per_thread_t *thd_data = drmgr_get_tls_field(drcontext, tls_index);
+
+    if (thd_data->tnt_count >= TNT_BITS)
+        flush_pending(drcontext, thd_data);
+    else
+        dump_data(drcontext);
 }
 
-void
+/* Write the pending repeats of the last block and the taken bits so far,
+ * any other record must come after them.
+ */
+static void
+flush_pending(void *drcontext, per_thread_t *thd_data)
+{
+    buf_repeat_t buf_item;
+    buf_tnt_t buf_tnt;
+
+    thd_data->repeat_end = NULL;
+    if (thd_data->repeat_count) {
+        buf_item.kind = KIND_REPEAT;
+        buf_item.count = thd_data->repeat_count;
+        thd_data->repeat_count = 0;
+
+        if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_repeat_t)) >= -thd_data->buf_end)
+            dump_data(drcontext);
+        *(buf_repeat_t*)thd_data->buf_ptr = buf_item;
+        thd_data->buf_ptr += sizeof(buf_repeat_t);
+    }
+
+    if (thd_data->tnt_count) {
+        buf_tnt.kind = KIND_TNT;
+        buf_tnt.count = thd_data->tnt_count;
+        memcpy(buf_tnt.bits, thd_data->tnt_bits, sizeof(buf_tnt.bits));
+        thd_data->tnt_count = 0;
+        memset(thd_data->tnt_bits, 0, sizeof(thd_data->tnt_bits));
+
+        if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_tnt_t)) >= -thd_data->buf_end)
+            dump_data(drcontext);
+        *(buf_tnt_t*)thd_data->buf_ptr = buf_tnt;
+        thd_data->buf_ptr += sizeof(buf_tnt_t);
+    }
+}
+
+/* Thread id tagging the ring chunks, parselog knows the main thread as 0 */
+static uint
+ring_thread_id(void *drcontext)
+{
+    thread_id_t thread_id = dr_get_thread_id(drcontext);
+    return thread_id == main_thread_id ? 0 : (uint)thread_id;
+}
+
+/* Time stamp counter as a record, the room for it is kept below buf_end */
+static void
+write_time(per_thread_t *thd_data)
+{
+    buf_time_t buf_item;
+
+    buf_item.kind = KIND_TIME;
+    buf_item.unused = 0;
+    buf_item.ts = __rdtsc();
+
+    *(buf_time_t*)thd_data->buf_ptr = buf_item;
+    thd_data->buf_ptr += sizeof(buf_time_t);
+}
+
+/* Header of the chunk the buffer will be written out as, completed by
+ * chunk_end at the flush
+ */
+static void
+chunk_begin(per_thread_t *thd_data)
+{
+    buf_chunk_t *chunk = (buf_chunk_t*)thd_data->buf_ptr;
+
+    chunk->kind = KIND_CHUNK;
+    chunk->size = 0;
+    chunk->seq = thd_data->num_chunks;
+    chunk->first_pc = NULL;
+    chunk->ts = __rdtsc();
+    chunk->offset = thd_data->file_pos;
+    thd_data->buf_ptr += sizeof(buf_chunk_t);
+}
+
+/* Complete the header of the buffer about to be written and index it */
+static void
+chunk_end(void *drcontext, per_thread_t *thd_data, size_t count)
+{
+    buf_chunk_t *chunk = (buf_chunk_t*)thd_data->buf_base;
+    uint kind = *(uint*)(chunk + 1);
+
+    chunk->size = (uint)count;
+    /* buffers mostly overflow at a block entry, its record comes first */
+    if (count > sizeof(buf_chunk_t)) {
+        if (kind & KIND_BB_ID) {
+            buf_block_t *desc = blocks_get(kind & BB_ID_MASK);
+            if (desc) chunk->first_pc = desc->pc;
+        } else if (kind == KIND_BB) {
+            chunk->first_pc = ((mem_ref_t*)(chunk + 1))->pc;
+        } else if (kind == KIND_TARGET) {
+            chunk->first_pc = ((buf_target_t*)(chunk + 1))->pc;
+        }
+    }
+
+    if (thd_data->num_chunks == thd_data->max_chunks) {
+        uint max_chunks = thd_data->max_chunks ? 2 * thd_data->max_chunks : 64;
+        buf_chunk_t *chunks = dr_thread_alloc(drcontext, max_chunks * sizeof(buf_chunk_t));
+        if (thd_data->chunks) {
+            memcpy(chunks, thd_data->chunks, thd_data->num_chunks * sizeof(buf_chunk_t));
+            dr_thread_free(drcontext, thd_data->chunks, thd_data->max_chunks * sizeof(buf_chunk_t));
+        }
+        thd_data->chunks = chunks;
+        thd_data->max_chunks = max_chunks;
+    }
+    thd_data->chunks[thd_data->num_chunks++] = *chunk;
+    thd_data->file_pos += count;
+}
+
+/* Append the chunk headers and the closing index record to the dump file,
+ * the writer must be done with it */
+static void
+chunk_write_index(per_thread_t *thd_data)
+{
+    buf_index_t buf_item;
+
+    buf_item.kind = KIND_INDEX;
+    buf_item.count = thd_data->num_chunks;
+    buf_item.offset = thd_data->file_pos;
+
+    if (thd_data->num_chunks)
+        dr_write_file(thd_data->dump_f, thd_data->chunks, thd_data->num_chunks * sizeof(buf_chunk_t));
+    dr_write_file(thd_data->dump_f, &buf_item, sizeof(buf_item));
+}
+
+/* buf_end stops short of the buffer end by a time record, and at the next
+ * time mark when one is due before it.
+ * buf_end is the negative of the address for the lea of the inline check.
+ */
+static void
+set_buf_end(per_thread_t *thd_data)
+{
+    char *end = thd_data->buf_base + thd_data->buf_sizes[thd_data->buf_idx] - sizeof(buf_time_t);
+
+    if (time_interval && thd_data->buf_ptr + time_interval < end)
+        end = thd_data->buf_ptr + time_interval;
+    thd_data->buf_end = -(ptr_int_t)end;
+    /* a nudge may have come in since, its buf_end stays */
+    if (thd_data->nudge)
+        thd_data->buf_end = -(ptr_int_t)thd_data->buf_base;
+}
+
+/* Close the dump file with its index and continue in <dump>-<n>, right
+ * after a flush
+ */
+static void
+dump_rotate(void *drcontext, per_thread_t *thd_data)
+{
+    char path[MAXIMUM_PATH];
+    bool mapped = thd_data->mapped;
+
+    for (uint i = 0; i < num_buffers; i++) {
+        writer_wait(&thd_data->buf_busy[i]);
+    }
+    if (mapped)
+        map_close(thd_data);
+    if (thd_data->dump_f != INVALID_FILE) {
+        if (!ring_enabled())
+            chunk_write_index(thd_data);
+        dr_close_file(thd_data->dump_f);
+    }
+
+    dr_snprintf(path, sizeof(path), "%s-%u", thd_data->dump_name, ++thd_data->rotations);
+    thd_data->num_chunks = 0;
+    thd_data->file_pos = 0;
+    /* the new file carries the text of its strings again */
+    if (thd_data->strings_sent)
+        memset(thd_data->strings_sent, 0, INTERN_MAX / 8);
+    if (mapped) {
+        thd_data->dump_f = map_open_file(path);
+        map_advance(drcontext, thd_data);
+        thd_data->buf_base = thd_data->bufs[0];
+    } else {
+        thd_data->dump_f = dr_open_file(path, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    }
+
+    /* the new buffer starts the new file */
+    thd_data->buf_ptr = thd_data->buf_base;
+    chunk_begin(thd_data);
+    set_buf_end(thd_data);
+
+    dr_fprintf(info_file, "tid:%d,dump:%s\n", dr_get_thread_id(drcontext), path);
+    dr_printf("%d] Rotate dump file: %s\n", dr_get_thread_id(drcontext), path);
+}
+
+/* Called when a record does not fit below buf_end: a time record goes in
+ * and the buffer is only written out once it is really full, or at once
+ * when nudged.
+ */
+static void
 dump_data(void *drcontext)
 {
     per_thread_t *thd_data = drmgr_get_tls_field(drcontext, tls_index);
-    size_t count = (size_t)(thd_data->buf_ptr - thd_data->buf_base);
+    /* taken at once, a nudge coming in later is done at the next record */
+    uint nudge = (uint)_InterlockedExchange((volatile long*)&thd_data->nudge, 0);
+
+    flush_pending(drcontext, thd_data);
+    if (nudge) {
+        flush_data(drcontext);
+        /* the shared -mux file stays */
+        if (nudge == NUDGE_ROTATE && !mux_enabled())
+            dump_rotate(drcontext, thd_data);
+        return;
+    }
+    if (time_interval &&
+        thd_data->buf_ptr + TIME_ROOM <=
+        thd_data->buf_base + thd_data->buf_sizes[thd_data->buf_idx] - sizeof(buf_time_t)) {
+        write_time(thd_data);
+        set_buf_end(thd_data);
+        return;
+    }
 
-    if (thd_data->dump_f != INVALID_FILE) {
-        dr_write_file(thd_data->dump_f, thd_data->buf_base, count);
+    flush_data(drcontext);
+}
+
+static void
+flush_data(void *drcontext)
+{
+    per_thread_t *thd_data = drmgr_get_tls_field(drcontext, tls_index);
+    size_t count;
+    uint64 write_ts;
+    bool timed = true;
+
+    flush_pending(drcontext, thd_data);
+    /* the flush is stamped too, the last one closes the thread */
+    write_time(thd_data);
+    count = (size_t)(thd_data->buf_ptr - thd_data->buf_base);
+
+    if ((thd_data->dump_f != INVALID_FILE || mux_enabled()) && count > 0) {
+        thd_data->stats.flushes++;
+        thd_data->stats.bytes += count;
+        chunk_end(drcontext, thd_data, count);
+        write_ts = __rdtsc();
+        if (thd_data->mapped) {
+            /* the records are in the file already */
+            map_advance(drcontext, thd_data);
+        } else if (mux_enabled()) {
+            /* a place of its own in the shared file, written right away */
+            mux_write(thd_data->serial, thd_data->num_chunks - 1,
+                thd_data->buf_base, count);
+        } else if (ring_enabled()) {
+            /* the copy into the ring is cheap, the consumer does the rest */
+            if (!ring_write(ring_thread_id(drcontext), thd_data->buf_base, count))
+                dr_write_file(thd_data->dump_f, thd_data->buf_base, count);
+        } else if (num_buffers > 1) {
+            /* hand the filled buffer to the writer and continue on the next one,
+             * the writer counts the ticks of the write itself */
+            writer_submit(thd_data->dump_f, thd_data->buf_base, count,
+                &thd_data->buf_busy[thd_data->buf_idx], &thd_data->stats.write_ticks);
+            timed = false;
+            thd_data->buf_idx = (thd_data->buf_idx + 1) % num_buffers;
+            if (writer_wait(&thd_data->buf_busy[thd_data->buf_idx]))
+                thd_data->stalls++;
+        } else {
+            dr_write_file(thd_data->dump_f, thd_data->buf_base, count);
+        }
+        if (timed)
+            thd_data->stats.write_ticks += __rdtsc() - write_ts;
+        buf_grow(drcontext, thd_data);
     }
 
+    thd_data->buf_base = thd_data->bufs[thd_data->buf_idx];
     thd_data->buf_ptr = thd_data->buf_base;
+    chunk_begin(thd_data);
+    set_buf_end(thd_data);
+}
+
+/* Before tracing starts or resumes: the threads ran blocks built plain,
+ * the next block of each has to record itself, its target in branch mode
+ * and as a link in calls mode. Plain blocks never touch the flags, a
+ * thread still in an instrumented block kept its trace going anyway.
+ */
+static void
+rearm_threads(void)
+{
+    void **drcontexts;
+    uint num, i;
+    per_thread_t *thd_data;
+
+    if (trace_mode != TRACE_MODE_BRANCH && trace_mode != TRACE_MODE_CALLS) return;
+
+    thd_data = drmgr_get_tls_field(dr_get_current_drcontext(), tls_index);
+    if (thd_data) {
+        thd_data->want_target = 1;
+        thd_data->link_pending = 1;
+    }
+
+    if (!dr_suspend_all_other_threads(&drcontexts, &num, NULL)) {
+        dr_printf("WARNING: Cannot suspend the threads, their next blocks may not record\n");
+        return;
+    }
+    for (i = 0; i < num; i++) {
+        thd_data = drmgr_get_tls_field(drcontexts[i], tls_index);
+        if (!thd_data) continue;
+        thd_data->want_target = 1;
+        thd_data->link_pending = 1;
+    }
+    dr_resume_all_other_threads(drcontexts, num);
+}
+
+/* Flush and rotate nudges: every thread gets a buf_end its next record
+ * cannot fit below, it writes its buffer out itself from dump_data where
+ * nothing of a block is pending. A thread blocked in the kernel does it
+ * once it runs again. set_buf_end keeps that buf_end while the nudge is
+ * pending.
+ */
+void
+bbtrace_flush(bool rotate)
+{
+    void **drcontexts;
+    uint num, i;
+
+    if (!dr_suspend_all_other_threads(&drcontexts, &num, NULL)) {
+        dr_printf("WARNING: Cannot suspend the threads to flush\n");
+        return;
+    }
+
+    for (i = 0; i < num; i++) {
+        per_thread_t *thd_data = drmgr_get_tls_field(drcontexts[i], tls_index);
+
+        if (!thd_data) continue;
+        if (rotate || thd_data->nudge != NUDGE_ROTATE)
+            thd_data->nudge = rotate ? NUDGE_ROTATE : NUDGE_FLUSH;
+        /* lea [-buf_end + ptr + size] is positive from the base on */
+        thd_data->buf_end = -(ptr_int_t)thd_data->buf_base;
+    }
+
+    dr_resume_all_other_threads(drcontexts, num);
+    dr_printf("Nudge: %s requested from %u threads\n", rotate ? "rotate" : "flush", num);
 }
 
 void
@@ -1242,6 +2578,7 @@ dump_symbol_data(buf_symbol_t *p_buf_item)
 
     DR_ASSERT(6 * sizeof(mem_ref_t) == sizeof(buf_symbol_t));
 
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_symbol_t)) >= -thd_data->buf_end)
         dump_data(drcontext);
     *(buf_symbol_t*)thd_data->buf_ptr = *p_buf_item;
@@ -1257,6 +2594,7 @@ dump_event_data(buf_event_t *p_buf_item)
 
     DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_event_t));
 
+    flush_pending(drcontext, thd_data);
     if ((ptr_int_t)(thd_data->buf_ptr + sizeof(buf_event_t)) >= -thd_data->buf_end)
         dump_data(drcontext);
     *(buf_event_t*)thd_data->buf_ptr = *p_buf_item;
@@ -1266,21 +2604,72 @@ dump_event_data(buf_event_t *p_buf_item)
 void
 add_dynamic_codes(void* start, void *end)
 {
-    range_t *range = dr_global_alloc(sizeof(range_t));
-    range->start = start;
-    range->end = end;
-    drvector_append(&vec_dynamic_codes, range);
+    rangetree_add(&tree_dynamic_codes, start, end);
 
-    if (rng_dynamic_codes.start == 0 || range->start < rng_dynamic_codes.start)
-      rng_dynamic_codes.start = range->start;
-    if (rng_dynamic_codes.end == 0 || range->end > rng_dynamic_codes.end)
-      rng_dynamic_codes.end = range->end;
+    if (rng_dynamic_codes.start == 0 || start < rng_dynamic_codes.start)
+      rng_dynamic_codes.start = start;
+    if (rng_dynamic_codes.end == 0 || end > rng_dynamic_codes.end)
+      rng_dynamic_codes.end = end;
 }
 
-static void
-free_range(void* range)
+void
+remove_dynamic_codes(void* start, void *end)
+{
+    rangetree_remove(&tree_dynamic_codes, start, end);
+}
+
+/* Add the ranges of a "0xA-0xB,0xC-0xD" list, as printed by grapher after
+ * --selected-range (the flag itself may be left in), returns how many.
+ */
+static uint
+selected_ranges_parse(const char *text)
+{
+    uint count = 0;
+    const char *p = text;
+    char *end;
+    app_pc start, stop;
+
+    while (*p) {
+        if (*p < '0' || *p > '9') {
+            p++;
+            continue;
+        }
+        start = (app_pc)strtoul(p, &end, 0);
+        if (*end != '-') {
+            p = end;
+            continue;
+        }
+        stop = (app_pc)strtoul(end + 1, &end, 0);
+        p = end;
+        if (start < stop) {
+            rangetree_add(&tree_selected, start, stop);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* Same from a file, the whole grapher output line can be saved there */
+static uint
+selected_ranges_load(const char *path)
 {
-    dr_global_free(range, sizeof(range_t));
+    file_t f = dr_open_file(path, DR_FILE_READ);
+    uint64 size;
+    char *text;
+    uint count = 0;
+
+    if (f == INVALID_FILE) return 0;
+
+    if (dr_file_size(f, &size) && size > 0) {
+        text = dr_global_alloc((size_t)size + 1);
+        text[dr_read_file(f, text, (size_t)size)] = 0;
+        count = selected_ranges_parse(text);
+        dr_global_free(text, (size_t)size + 1);
+    }
+    dr_close_file(f);
+
+    return count;
 }
 
 file_t
@@ -1301,7 +2690,7 @@ char* set_dump_path(client_id_t id, dr_time_t* start_time)
 }
 
 void
-bbtrace_init(client_id_t id, bool is_enable_memtrace)
+bbtrace_init(client_id_t id, const bbtrace_options_t *options)
 {
     char path[MAXIMUM_PATH];
     dr_time_t start_time;
@@ -1310,7 +2699,26 @@ bbtrace_init(client_id_t id, bool is_enable_memtrace)
 
     dr_get_time(&start_time);
 
-    enable_memtrace = is_enable_memtrace;
+    enable_memtrace = options->enable_memtrace;
+    num_buffers = options->num_buffers;
+    if (num_buffers < 1) num_buffers = 1;
+    if (num_buffers > MAX_WRITER_BUFFERS) num_buffers = MAX_WRITER_BUFFERS;
+    enable_compact = options->enable_compact;
+    trace_mode = options->trace_mode;
+    if (options->buf_size) buf_init_size = options->buf_size * 1024;
+    if (buf_init_size < BUF_MIN_SIZE) buf_init_size = BUF_MIN_SIZE;
+    buf_max_size = options->buf_max * 1024;
+    if (buf_max_size < buf_init_size) buf_max_size = buf_init_size;
+    time_interval = options->time_interval * 1024;
+    if (time_interval >= buf_max_size) time_interval = 0;
+    large_pages = options->large_pages;
+    demote_threshold = options->demote;
+    if (large_pages) {
+        if (lock_memory_enabled())
+            large_page_size = GetLargePageMinimum();
+        else
+            dr_printf("WARNING: SeLockMemoryPrivilege not enabled, plain raw memory\n");
+    }
 
     set_dump_path(id, &start_time);
     dr_snprintf(path, sizeof(path), "%s.txt", dump_path);
@@ -1318,22 +2726,111 @@ bbtrace_init(client_id_t id, bool is_enable_memtrace)
     info_file = dr_open_file(path, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
 
     dr_fprintf(info_file, "pid:%d,name:%s\n", pid, app_name);
+    stats_init(info_file, options->stats_interval);
+
+    dr_fprintf(info_file, "mode:%s\n",
+        trace_mode == TRACE_MODE_COVERAGE ? "coverage" :
+        trace_mode == TRACE_MODE_BRANCH ? "branch" :
+        trace_mode == TRACE_MODE_CALLS ? "calls" : "trace");
+
+    if (trace_mode == TRACE_MODE_BRANCH && enable_memtrace) {
+        dr_printf("WARNING: memtrace is not available in branch mode\n");
+        enable_memtrace = false;
+    }
+    if (trace_mode == TRACE_MODE_CALLS && enable_memtrace) {
+        dr_printf("WARNING: memtrace is not available in calls mode\n");
+        enable_memtrace = false;
+    }
+
+    if (demote_threshold && trace_mode != TRACE_MODE_TRACE) {
+        dr_printf("WARNING: -demote is only available in trace mode\n");
+        demote_threshold = 0;
+    }
+
+    if (enable_compact || demote_threshold ||
+        trace_mode == TRACE_MODE_COVERAGE || trace_mode == TRACE_MODE_BRANCH) {
+        dr_snprintf(path, sizeof(path), "%s.blocks", dump_path);
+        blocks_init(path, trace_mode == TRACE_MODE_COVERAGE || demote_threshold);
+        dr_fprintf(info_file, "blocks:%s\n", path);
+    }
+
+    if (options->ring_size) {
+        /* room for a couple of the largest buffers at least */
+        size_t ring_size = options->ring_size * 1024 * 1024;
+        if (ring_size < 2 * buf_max_size) ring_size = 2 * buf_max_size;
+
+        dr_snprintf(path, sizeof(path), "Local\\bbtrace.%d", pid);
+        if (ring_init(path, ring_size, options->ring_full)) {
+            dr_fprintf(info_file, "ring:%s\n", path);
+            dr_printf("Ring: %s\n", path);
+        } else {
+            dr_printf("WARNING: Unable to create ring %s, writing dump files\n", path);
+        }
+    }
+
+    if (options->enable_mux && !ring_enabled()) {
+        dr_snprintf(path, sizeof(path), "%s.mux", dump_path);
+        if (mux_init(path)) {
+            dr_fprintf(info_file, "mux:%s\n", path);
+        } else {
+            dr_printf("WARNING: Unable to create %s, writing dump files\n", path);
+        }
+    }
+
+    enable_mmap = options->enable_mmap;
+    if (enable_mmap && (ring_enabled() || mux_enabled())) {
+        dr_printf("WARNING: -mmap is not available with -ring or -mux\n");
+        enable_mmap = false;
+    }
+    if (enable_mmap) {
+        /* the window is the only buffer, no writer */
+        num_buffers = 1;
+        dr_fprintf(info_file, "mmap:1\n");
+    }
+
+    drreg_options_t ops = {sizeof(ops), 4 /*max slots needed*/, false};
 
     drmgr_init();
+    drx_init();
+    if (drreg_init(&ops) != DRREG_SUCCESS)
+        DR_ASSERT_MSG(false, "Unable to init drreg");
     drutil_init();
     drwrap_init();
     drwrap_set_global_flags(DRWRAP_NO_FRILLS | DRWRAP_FAST_CLEANCALLS);
 
     winapi_init();
+    intern_init();
+    if (options->api_spec && options->api_spec[0]) {
+        uint count = winapi_load_spec(options->api_spec);
+        if (!count)
+            dr_printf("WARNING: No API read from %s, wrapping the built-in ones\n", options->api_spec);
+        dr_fprintf(info_file, "api_spec:%u,file:%s\n", count, options->api_spec);
+    }
     synchro_init();
 
     tls_index = drmgr_register_tls_field();
     DR_ASSERT(tls_index != -1);
 
-    codecache_init(clean_call, DR_REG_XCX);
-    drvector_init(&vec_dynamic_codes, 10, false, free_range);
+    modules_init();
+    codecache_init(clean_call);
+    if (num_buffers > 1) writer_init();
+    rangetree_init(&tree_dynamic_codes);
     memset(&rng_dynamic_codes, 0, sizeof(range_t));
 
+    rangetree_init(&tree_selected);
+    if (options->ranges && options->ranges[0]) {
+        uint count = selected_ranges_parse(options->ranges);
+        dr_fprintf(info_file, "ranges:%u\n", count);
+        enable_ranges = true;
+    }
+    if (options->ranges_file && options->ranges_file[0]) {
+        uint count = selected_ranges_load(options->ranges_file);
+        if (!count)
+            dr_printf("WARNING: No range read from %s\n", options->ranges_file);
+        dr_fprintf(info_file, "ranges:%u,file:%s\n", count, options->ranges_file);
+        enable_ranges = true;
+    }
+
     drmgr_register_thread_init_event(event_thread_init);
     drmgr_register_thread_exit_event(event_thread_exit);
     drmgr_register_bb_instrumentation_ex_event(event_bb_app2app,
@@ -1343,11 +2840,16 @@ bbtrace_init(client_id_t id, bool is_enable_memtrace)
     drmgr_register_exception_event(event_exception);
 
     app_exe = dr_get_main_module();
+    trigger_init(&options->trigger, app_exe, rearm_threads);
 }
 
 void
 bbtrace_exit(void)
 {
+    writer_exit();
+    ring_exit();
+    mux_exit();
+    stats_exit();
     dr_free_module_data(app_exe);
 
     drmgr_unregister_exception_event(event_exception);
@@ -1359,16 +2861,23 @@ bbtrace_exit(void)
     drmgr_unregister_thread_exit_event(event_thread_exit);
     drmgr_unregister_thread_init_event(event_thread_init);
 
-    drvector_delete(&vec_dynamic_codes);
+    rangetree_delete(&tree_dynamic_codes);
+    rangetree_delete(&tree_selected);
     codecache_exit();
+    modules_exit();
+    blocks_exit();
 
     drmgr_unregister_tls_field(tls_index);
 
     synchro_exit();
     winapi_exit();
+    intern_exit();
+    trigger_exit();
 
     drwrap_exit();
     drutil_exit();
+    drreg_exit();
+    drx_exit();
     drmgr_exit();
 
     if (info_file != INVALID_FILE) {
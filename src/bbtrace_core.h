@@ -10,6 +10,7 @@ extern "C" {
 void dump_symbol_data(buf_symbol_t *buf_item);
 void dump_event_data(buf_event_t *buf_item);
 void add_dynamic_codes(void* start, void *end);
+void remove_dynamic_codes(void* start, void *end);
 void lib_entry(void *wrapcxt, INOUT void **user_data);
 void lib_exit(void *wrapcxt, INOUT void *user_data);
 void WndProc_entry(void *wrapcxt, INOUT void **user_data);
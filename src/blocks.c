@@ -0,0 +1,227 @@
+#include "dr_api.h"
+#include "hashtable.h"
+#include "drvector.h"
+#include "blocks.h"
+
+/* Block table: every distinct instrumented block gets an id and its
+ * descriptor is written once to the .blocks file, the per-thread traces
+ * then only refer to the id. With memtrace the descriptor is followed by
+ * the static part of the block memory refs, the traces only keep the
+ * addresses.
+ */
+
+typedef struct _block_entry_t {
+    buf_block_t desc;
+    struct _block_entry_t *next; /* same pc, different code */
+    bool demoted;
+} block_entry_t;
+
+#define BLOCKS_OUT_SIZE (256 * sizeof(buf_block_t))
+
+static hashtable_t block_table;
+static drvector_t vec_blocks;
+static void *blocks_lock = NULL;
+static file_t blocks_file = INVALID_FILE;
+static char blocks_out[BLOCKS_OUT_SIZE];
+static uint blocks_out_count = 0;
+/* execution counters indexed by block id, updated inline */
+static uint *block_counts = NULL;
+
+static void
+free_block_entry(void *entry)
+{
+    dr_global_free(entry, sizeof(block_entry_t));
+}
+
+static void
+blocks_flush(void)
+{
+    if (blocks_out_count && blocks_file != INVALID_FILE) {
+        dr_write_file(blocks_file, blocks_out, blocks_out_count);
+    }
+    blocks_out_count = 0;
+}
+
+static void
+blocks_write(const void *data, uint size)
+{
+    if (blocks_out_count + size > BLOCKS_OUT_SIZE)
+        blocks_flush();
+    if (size > BLOCKS_OUT_SIZE) {
+        if (blocks_file != INVALID_FILE)
+            dr_write_file(blocks_file, data, size);
+        return;
+    }
+    memcpy(&blocks_out[blocks_out_count], data, size);
+    blocks_out_count += size;
+}
+
+void
+blocks_init(const char *path, bool counting)
+{
+    if (blocks_lock) return;
+
+    DR_ASSERT(2 * sizeof(mem_ref_t) == sizeof(buf_block_t));
+
+    hashtable_init(&block_table, 10, HASH_INTPTR, false);
+    drvector_init(&vec_blocks, 1024, false, free_block_entry);
+    blocks_lock = dr_mutex_create();
+
+    blocks_file = dr_open_file(path, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+
+    if (counting) {
+        block_counts = dr_raw_mem_alloc(MAX_BLOCK_COUNTERS * sizeof(uint),
+            DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+        memset(block_counts, 0, MAX_BLOCK_COUNTERS * sizeof(uint));
+    }
+}
+
+/* Append the final counts after the descriptors */
+static void
+blocks_dump_counts(void)
+{
+    buf_block_count_t buf_item = {0};
+
+    DR_ASSERT(sizeof(mem_ref_t) == sizeof(buf_block_count_t));
+    buf_item.kind = KIND_COUNT;
+
+    for (uint id = 1; id <= vec_blocks.entries && id < MAX_BLOCK_COUNTERS; id++) {
+        block_entry_t *entry = drvector_get_entry(&vec_blocks, id - 1);
+
+        if (block_counts[id] == 0) continue;
+        buf_item.id = id;
+        buf_item.count = block_counts[id];
+        buf_item.flags = entry->demoted ? BLOCK_COUNT_DEMOTED : 0;
+        dr_write_file(blocks_file, &buf_item, sizeof(buf_item));
+    }
+}
+
+void
+blocks_exit(void)
+{
+    if (!blocks_lock) return;
+
+    blocks_flush();
+    if (blocks_file != INVALID_FILE) {
+        if (block_counts) blocks_dump_counts();
+        dr_close_file(blocks_file);
+        blocks_file = INVALID_FILE;
+    }
+    if (block_counts) {
+        dr_raw_mem_free(block_counts, MAX_BLOCK_COUNTERS * sizeof(uint));
+        block_counts = NULL;
+    }
+
+    hashtable_delete(&block_table);
+    drvector_delete(&vec_blocks);
+    dr_mutex_destroy(blocks_lock);
+    blocks_lock = NULL;
+}
+
+/* Returns the id of the block, a new descriptor is emitted on first sight.
+ * desc holds all but kind and id, refs its desc->refs memory ref templates.
+ */
+uint
+blocks_add(const buf_block_t *desc, const mem_ref_t *refs)
+{
+    block_entry_t *head, *entry;
+    uint id;
+
+    dr_mutex_lock(blocks_lock);
+
+    head = hashtable_lookup(&block_table, desc->pc);
+    for (entry = head; entry; entry = entry->next) {
+        if (entry->desc.last_pc == desc->last_pc && entry->desc.size == desc->size &&
+            entry->desc.refs == desc->refs && entry->desc.target == desc->target &&
+            entry->desc.branch == desc->branch)
+            break;
+    }
+
+    if (!entry) {
+        entry = dr_global_alloc(sizeof(block_entry_t));
+        entry->desc = *desc;
+        entry->desc.kind = KIND_BLOCK;
+        entry->desc.id = vec_blocks.entries + 1;
+        entry->next = head;
+        entry->demoted = false;
+
+        drvector_append(&vec_blocks, entry);
+        hashtable_add_replace(&block_table, desc->pc, entry);
+
+        blocks_write(&entry->desc, sizeof(buf_block_t));
+        if (desc->refs)
+            blocks_write(refs, desc->refs * sizeof(mem_ref_t));
+    }
+    id = entry->desc.id;
+
+    dr_mutex_unlock(blocks_lock);
+
+    DR_ASSERT((id & KIND_BB_ID) == 0);
+    return id;
+}
+
+buf_block_t *
+blocks_get(uint id)
+{
+    block_entry_t *entry = NULL;
+
+    if (id == 0) return NULL;
+
+    dr_mutex_lock(blocks_lock);
+    if (id <= vec_blocks.entries)
+        entry = drvector_get_entry(&vec_blocks, id - 1);
+    dr_mutex_unlock(blocks_lock);
+
+    return entry ? &entry->desc : NULL;
+}
+
+/* Address of the execution counter of block id, NULL when out of slots */
+uint *
+blocks_counter(uint id)
+{
+    if (!block_counts || id == 0 || id >= MAX_BLOCK_COUNTERS)
+        return NULL;
+    return &block_counts[id];
+}
+
+/* Mark the block as only counted from now on, true the first time */
+bool
+blocks_demote(uint id)
+{
+    block_entry_t *entry = NULL;
+    bool first = false;
+
+    if (id == 0) return false;
+
+    dr_mutex_lock(blocks_lock);
+    if (id <= vec_blocks.entries)
+        entry = drvector_get_entry(&vec_blocks, id - 1);
+    if (entry && !entry->demoted) {
+        entry->demoted = true;
+        first = true;
+    }
+    dr_mutex_unlock(blocks_lock);
+
+    return first;
+}
+
+bool
+blocks_demoted(uint id)
+{
+    block_entry_t *entry = NULL;
+
+    if (id == 0) return false;
+
+    dr_mutex_lock(blocks_lock);
+    if (id <= vec_blocks.entries)
+        entry = drvector_get_entry(&vec_blocks, id - 1);
+    dr_mutex_unlock(blocks_lock);
+
+    return entry && entry->demoted;
+}
+
+uint
+blocks_count(void)
+{
+    return vec_blocks.entries;
+}
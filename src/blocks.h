@@ -0,0 +1,24 @@
+#pragma once
+
+#include "dr_api.h"
+#include "datatypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Capacity of the execution counter table */
+#define MAX_BLOCK_COUNTERS (1 << 20)
+
+void blocks_init(const char *path, bool counting);
+void blocks_exit(void);
+uint blocks_add(const buf_block_t *desc, const mem_ref_t *refs);
+uint *blocks_counter(uint id);
+bool blocks_demote(uint id);
+bool blocks_demoted(uint id);
+buf_block_t *blocks_get(uint id);
+uint blocks_count(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,15 +1,23 @@
 #include "dr_api.h"
 #include "codecache.h"
 
+/* One lean procedure per general purpose register: the inlined code puts
+ * the address to come back to in whichever scratch register it has and
+ * jumps to the matching procedure.
+ */
+#define NUM_BACK_REGS (DR_REG_XDI - DR_REG_XAX + 1)
+
 static app_pc code_cache = NULL;
+static app_pc code_entries[NUM_BACK_REGS];
 
 void
-codecache_init(void *clean_call, reg_t back)
+codecache_init(void *clean_call)
 {
     void         *drcontext;
     instrlist_t  *ilist;
     instr_t      *where;
-    byte         *end;
+    byte         *pc;
+    reg_id_t     back;
 
     if (code_cache) return;
 
@@ -18,17 +26,26 @@ codecache_init(void *clean_call, reg_t back)
                                   DR_MEMPROT_READ  |
                                   DR_MEMPROT_WRITE |
                                   DR_MEMPROT_EXEC);
-    ilist = instrlist_create(drcontext);
-    /* The lean procecure simply performs a clean call, and then jump back */
-    /* jump back to the DR's code cache */
-    where = INSTR_CREATE_jmp_ind(drcontext, opnd_create_reg(back));
-    instrlist_meta_append(ilist, where);
-    /* clean call */
-    dr_insert_clean_call(drcontext, ilist, where, (void *)clean_call, false, 0);
-    /* Encodes the instructions into memory and then cleans up. */
-    end = instrlist_encode(drcontext, ilist, code_cache, false);
-    DR_ASSERT((end - code_cache) < dr_page_size());
-    instrlist_clear_and_destroy(drcontext, ilist);
+    pc = code_cache;
+    memset(code_entries, 0, sizeof(code_entries));
+
+    for (back = DR_REG_XAX; back <= DR_REG_XDI; back++) {
+        if (back == DR_REG_XSP) continue;
+
+        ilist = instrlist_create(drcontext);
+        /* The lean procecure simply performs a clean call, and then jump back */
+        /* jump back to the DR's code cache */
+        where = INSTR_CREATE_jmp_ind(drcontext, opnd_create_reg(back));
+        instrlist_meta_append(ilist, where);
+        /* clean call */
+        dr_insert_clean_call(drcontext, ilist, where, (void *)clean_call, false, 0);
+        /* Encodes the instructions into memory and then cleans up. */
+        code_entries[back - DR_REG_XAX] = pc;
+        pc = instrlist_encode(drcontext, ilist, pc, false);
+        DR_ASSERT((pc - code_cache) < dr_page_size());
+        instrlist_clear_and_destroy(drcontext, ilist);
+    }
+
     /* set the memory as just +rx now */
     dr_memory_protect(code_cache, dr_page_size(), DR_MEMPROT_READ | DR_MEMPROT_EXEC);
 }
@@ -37,9 +54,11 @@ void
 codecache_exit(void)
 {
     dr_nonheap_free(code_cache, dr_page_size());
+    code_cache = NULL;
 }
 
 app_pc
-codecache_get(void) {
-    return code_cache;
+codecache_get(reg_id_t back) {
+    DR_ASSERT(back >= DR_REG_XAX && back <= DR_REG_XDI && back != DR_REG_XSP);
+    return code_entries[back - DR_REG_XAX];
 }
@@ -6,9 +6,9 @@
 extern "C" {
 #endif
 
-void codecache_init(void* clean_call, reg_t back);
+void codecache_init(void* clean_call);
 void codecache_exit(void);
-app_pc codecache_get(void);
+app_pc codecache_get(reg_id_t back);
 
 #ifdef __cplusplus
 }
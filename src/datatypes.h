@@ -34,6 +34,19 @@
 #define KIND_LOOP 0x706F6F4C // 'Loop'
 // #define KIND_STOP 0x504F5453 // 'Stop' (loop-stop unused)
 #define KIND_SYNC 0x636E7953  // 'Sync'
+#define KIND_BLOCK 0x6B636C42 // 'Blck'
+#define KIND_COUNT 0x746E4342 // 'BCnt'
+#define KIND_REPEAT 0x74706552 // 'Rept'
+#define KIND_TNT 0x73746942 // 'Bits'
+#define KIND_TARGET 0x74677254 // 'Trgt'
+#define KIND_TIME 0x656D6954 // 'Time'
+#define KIND_CHUNK 0x6B6E6843 // 'Chnk'
+#define KIND_INDEX 0x78646E49 // 'Indx'
+
+/* Compact block record: a single uint, KIND_BB_ID flag plus the block id.
+ * No printable kind has the top bit set. */
+#define KIND_BB_ID 0x80000000
+#define BB_ID_MASK 0x7FFFFFFF
 
 #define SYNC_MUTEX 0x7874754D // 'Mutx'
 #define SYNC_EVENT 0x746E7645 // 'Evnt'
@@ -47,6 +60,15 @@ enum {
 
 #define LINK_SHIFT_FIELD 8
 
+/* How a block hands over to the next one, for branch traces */
+enum {
+    BRANCH_DIRECT = 0,  // fall-through, direct jmp or call: to target
+    BRANCH_COND,        // jcc: to target when taken, one bit per run
+    BRANCH_INDIRECT     // anything else: a target record follows
+};
+
+#define TNT_BITS 64
+
 typedef struct _mem_ref_t {
     uint kind;
     uint addr;
@@ -89,6 +111,24 @@ typedef struct _buf_string_t {
     char value[12+ (5*16)];
 } buf_string_t; // 6*16
 
+/* Interned string arg: the first use in a thread carries the text with
+ * its id, the next ones only the id. Ids are shared by the threads.
+ */
+#define KIND_STRING_DEF 0x66654453 // 'SDef'
+#define KIND_STRING_REF 0x66655253 // 'SRef'
+
+typedef struct _buf_string_def_t {
+    uint kind;
+    uint id;
+    char value[8+ (5*16)];
+} buf_string_def_t; // 6*16
+
+typedef struct _buf_string_ref_t {
+    uint kind;
+    uint id;
+    uint unused[2];
+} buf_string_ref_t; // 16
+
 typedef struct _buf_app_call_t {
     uint kind;
     app_pc instr_addr;
@@ -116,6 +156,105 @@ typedef struct _buf_event_t {
     uint params[3];
 } buf_event_t; // 16
 
+typedef struct _buf_block_t {
+    uint kind;
+    uint id;
+    app_pc pc;
+    app_pc last_pc;
+    uint size; // len_last | link << LINK_SHIFT_FIELD, as KIND_BB
+    uint refs; // mem_ref_t templates following the descriptor
+    app_pc target; // next block of a direct or taken conditional branch
+    uint branch; // BRANCH_*
+} buf_block_t; // 2*16
+
+typedef struct _buf_block_count_t {
+    uint kind;
+    uint id;
+    uint count;
+    uint flags; // BLOCK_COUNT_*
+} buf_block_count_t; // 16
+
+/* the block was only counted once it ran -demote times, not traced */
+#define BLOCK_COUNT_DEMOTED 1
+
+typedef struct _buf_repeat_t {
+    uint kind;
+    uint count; // executions of the previous block beyond its record
+} buf_repeat_t; // 8
+
+typedef struct _buf_tnt_t {
+    uint kind;
+    uint count; // used bits
+    uint bits[TNT_BITS / 32]; // taken bits, oldest at bit 0
+} buf_tnt_t; // 16
+
+typedef struct _buf_target_t {
+    uint kind;
+    app_pc pc; // block reached through an indirect branch
+} buf_target_t; // 8
+
+typedef struct _buf_time_t {
+    uint kind;
+    uint unused;
+    uint64 ts; // time stamp counter, shared by all threads
+} buf_time_t; // 16
+
+/* Every flushed buffer is a chunk starting with this header, at thread
+ * exit copies of all of them follow the last chunk as the index, with a
+ * buf_index_t closing the file.
+ */
+typedef struct _buf_chunk_t {
+    uint kind;
+    uint size; // bytes of the chunk, this header included
+    uint seq; // chunk number in the dump file
+    app_pc first_pc; // block the chunk starts with, 0 if it starts otherwise
+    uint64 ts; // time stamp counter at the chunk start
+    uint64 offset; // of the chunk in the dump file
+} buf_chunk_t; // 2*16
+
+typedef struct _buf_index_t {
+    uint kind;
+    uint count; // chunk headers right before this record
+    uint64 offset; // of the first of them
+} buf_index_t; // 16
+
+/* Shared memory ring the tracer streams filled buffers into, a header
+ * followed by the data area. head and tail run free, modulo size.
+ */
+#define RING_MAGIC 0x676E6952 // 'Ring'
+
+typedef struct _ring_header_t {
+    uint magic;
+    uint size; // bytes of the data area, power of two
+    volatile uint head; // written up to, advanced by the tracer
+    volatile uint tail; // read up to, advanced by the consumer
+    volatile uint closed; // the tracer has exited
+    uint dropped; // buffers lost while the ring was full
+    uint spilled; // buffers written to the dump file instead
+    uint unused;
+} ring_header_t; // 2*16
+
+typedef struct _ring_chunk_t {
+    uint thread_id; // 0 for the main thread
+    uint count; // bytes of trace following, 0 when the thread exits
+} ring_chunk_t; // 8
+
+#define RING_ALIGN sizeof(ring_chunk_t)
+
+/* Dump file shared by all the threads (-mux): each flushed buffer follows
+ * a header telling its thread. The file closes with a copy of all the
+ * headers and a buf_index_t, like the chunk index of a thread dump.
+ */
+#define KIND_MUX 0x4378754D // 'MuxC'
+
+typedef struct _mux_chunk_t {
+    uint kind;
+    uint serial; // of the thread in the run (tid: line of the info file), 0 for the main thread
+    uint count; // bytes of trace following
+    uint seq; // of the chunk in the thread
+    uint64 offset; // of this header in the file
+} mux_chunk_t; // 24
+
 typedef struct _range_t {
     void* start;
     void* end;
@@ -0,0 +1,59 @@
+#include "dr_api.h"
+#include "hashtable.h"
+#include "intern.h"
+
+/* String args of the wrapped calls: each distinct one gets an id of the
+ * process, the trace carries its text only once per thread.
+ */
+
+static hashtable_t intern_table;
+static void *intern_lock = NULL;
+static uint num_interned = 0;
+
+void
+intern_init(void)
+{
+    if (intern_lock) return;
+
+    /* keys are copied, the lookup and the add go under one lock */
+    hashtable_init_ex(&intern_table, 10, HASH_STRING, true, false, NULL, NULL, NULL);
+    intern_lock = dr_mutex_create();
+}
+
+void
+intern_exit(void)
+{
+    if (!intern_lock) return;
+
+    hashtable_delete(&intern_table);
+    dr_mutex_destroy(intern_lock);
+    intern_lock = NULL;
+}
+
+/* Id of str, INTERN_NONE once the table is full */
+uint
+intern_string(const char *str)
+{
+    void *payload;
+    uint id;
+
+    dr_mutex_lock(intern_lock);
+    payload = hashtable_lookup(&intern_table, (void*)str);
+    if (payload) {
+        id = (uint)(ptr_uint_t)payload - 1;
+    } else if (num_interned >= INTERN_MAX) {
+        id = INTERN_NONE;
+    } else {
+        id = num_interned++;
+        hashtable_add(&intern_table, (void*)str, (void*)(ptr_uint_t)(id + 1));
+    }
+    dr_mutex_unlock(intern_lock);
+
+    return id;
+}
+
+uint
+intern_count(void)
+{
+    return num_interned;
+}
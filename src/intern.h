@@ -0,0 +1,20 @@
+#pragma once
+
+#include "dr_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Distinct strings taken at most, the next ones are written out in full */
+#define INTERN_MAX (64 * 1024)
+#define INTERN_NONE ((uint)-1)
+
+void intern_init(void);
+void intern_exit(void);
+uint intern_string(const char *str);
+uint intern_count(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,123 @@
+#include "dr_api.h"
+#include "modules.h"
+
+/* Module range table: kept sorted by start address by the module
+ * load/unload events, so the block builder can tell which module a pc
+ * belongs to with a binary search instead of dr_lookup_module.
+ */
+
+typedef struct _module_range_t {
+    app_pc start;
+    app_pc end;
+    bool is_exe;
+} module_range_t;
+
+#define MODULES_INIT_CAPACITY 64
+
+static module_range_t *ranges = NULL;
+static uint ranges_count = 0;
+static uint ranges_capacity = 0;
+static void *ranges_lock = NULL;
+
+void
+modules_init(void)
+{
+    if (ranges_lock) return;
+
+    ranges_lock = dr_rwlock_create();
+    ranges_capacity = MODULES_INIT_CAPACITY;
+    ranges_count = 0;
+    ranges = dr_global_alloc(ranges_capacity * sizeof(module_range_t));
+}
+
+void
+modules_exit(void)
+{
+    if (!ranges_lock) return;
+
+    dr_global_free(ranges, ranges_capacity * sizeof(module_range_t));
+    ranges = NULL;
+    ranges_count = ranges_capacity = 0;
+    dr_rwlock_destroy(ranges_lock);
+    ranges_lock = NULL;
+}
+
+/* Index of the first range with start > pc, caller holds the lock */
+static uint
+modules_upper_bound(app_pc pc)
+{
+    uint lo = 0, hi = ranges_count;
+
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        if (ranges[mid].start <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+void
+modules_add(const module_data_t *mod, bool is_exe)
+{
+    uint pos;
+
+    dr_rwlock_write_lock(ranges_lock);
+
+    if (ranges_count == ranges_capacity) {
+        module_range_t *grown = dr_global_alloc(2 * ranges_capacity * sizeof(module_range_t));
+        memcpy(grown, ranges, ranges_count * sizeof(module_range_t));
+        dr_global_free(ranges, ranges_capacity * sizeof(module_range_t));
+        ranges = grown;
+        ranges_capacity *= 2;
+    }
+
+    pos = modules_upper_bound(mod->start);
+    memmove(&ranges[pos + 1], &ranges[pos], (ranges_count - pos) * sizeof(module_range_t));
+    ranges[pos].start = mod->start;
+    ranges[pos].end = mod->end;
+    ranges[pos].is_exe = is_exe;
+    ranges_count++;
+
+    dr_rwlock_write_unlock(ranges_lock);
+}
+
+void
+modules_remove(const module_data_t *mod)
+{
+    uint pos;
+
+    dr_rwlock_write_lock(ranges_lock);
+
+    pos = modules_upper_bound(mod->start);
+    if (pos > 0 && ranges[pos - 1].start == mod->start) {
+        pos--;
+        memmove(&ranges[pos], &ranges[pos + 1], (ranges_count - pos - 1) * sizeof(module_range_t));
+        ranges_count--;
+    }
+
+    dr_rwlock_write_unlock(ranges_lock);
+}
+
+/* Find the module holding pc, returns false if pc is outside any module */
+bool
+modules_lookup(app_pc pc, app_pc *start, bool *is_exe)
+{
+    bool found = false;
+    uint pos;
+
+    dr_rwlock_read_lock(ranges_lock);
+
+    pos = modules_upper_bound(pc);
+    if (pos > 0 && pc < ranges[pos - 1].end) {
+        if (start) *start = ranges[pos - 1].start;
+        if (is_exe) *is_exe = ranges[pos - 1].is_exe;
+        found = true;
+    }
+
+    dr_rwlock_read_unlock(ranges_lock);
+
+    return found;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "dr_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void modules_init(void);
+void modules_exit(void);
+void modules_add(const module_data_t *mod, bool is_exe);
+void modules_remove(const module_data_t *mod);
+bool modules_lookup(app_pc pc, app_pc *start, bool *is_exe);
+
+#ifdef __cplusplus
+}
+#endif
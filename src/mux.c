@@ -0,0 +1,108 @@
+#include "dr_api.h"
+#include <windows.h>
+#include "datatypes.h"
+#include "mux.h"
+
+/* One dump file for all the threads: a flush reserves its place with an
+ * atomic add on the file end and writes there, no lock on the way. Only
+ * the copy of the header kept for the index at exit takes one.
+ */
+
+static HANDLE mux_file = INVALID_HANDLE_VALUE;
+static volatile LONGLONG mux_end = 0;
+static void *mux_lock = NULL;
+static mux_chunk_t *mux_index = NULL;
+static uint mux_count = 0;
+static uint mux_max = 0;
+
+/* Write at an offset, the threads write their chunks side by side */
+static bool
+mux_write_at(uint64 pos, const void *data, size_t count)
+{
+    OVERLAPPED ov;
+    DWORD written;
+
+    memset(&ov, 0, sizeof(ov));
+    ov.Offset = (DWORD)pos;
+    ov.OffsetHigh = (DWORD)(pos >> 32);
+
+    return WriteFile(mux_file, data, (DWORD)count, &written, &ov) && written == count;
+}
+
+bool
+mux_init(const char *path)
+{
+    if (mux_file != INVALID_HANDLE_VALUE) return true;
+
+    mux_file = CreateFileA(path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mux_file == INVALID_HANDLE_VALUE) return false;
+
+    mux_end = 0;
+    mux_lock = dr_mutex_create();
+    return true;
+}
+
+/* Append the index of the chunks and close, the threads are done */
+void
+mux_exit(void)
+{
+    buf_index_t buf_item;
+
+    if (mux_file == INVALID_HANDLE_VALUE) return;
+
+    buf_item.kind = KIND_INDEX;
+    buf_item.count = mux_count;
+    buf_item.offset = (uint64)mux_end;
+
+    if (mux_count)
+        mux_write_at(buf_item.offset, mux_index, mux_count * sizeof(mux_chunk_t));
+    mux_write_at(buf_item.offset + mux_count * sizeof(mux_chunk_t), &buf_item, sizeof(buf_item));
+
+    CloseHandle(mux_file);
+    mux_file = INVALID_HANDLE_VALUE;
+
+    if (mux_index)
+        dr_global_free(mux_index, mux_max * sizeof(mux_chunk_t));
+    mux_index = NULL;
+    mux_count = mux_max = 0;
+    dr_mutex_destroy(mux_lock);
+    mux_lock = NULL;
+}
+
+bool
+mux_enabled(void)
+{
+    return mux_file != INVALID_HANDLE_VALUE;
+}
+
+/* Chunk seq of the thread with the given serial, its header then the count bytes of trace */
+bool
+mux_write(uint serial, uint seq, const char *data, size_t count)
+{
+    mux_chunk_t chunk;
+    LONGLONG size = (LONGLONG)(sizeof(mux_chunk_t) + count);
+
+    chunk.kind = KIND_MUX;
+    chunk.serial = serial;
+    chunk.count = (uint)count;
+    chunk.seq = seq;
+    chunk.offset = (uint64)(InterlockedExchangeAdd64(&mux_end, size));
+
+    dr_mutex_lock(mux_lock);
+    if (mux_count == mux_max) {
+        uint max = mux_max ? 2 * mux_max : 1024;
+        mux_chunk_t *index = dr_global_alloc(max * sizeof(mux_chunk_t));
+        if (mux_index) {
+            memcpy(index, mux_index, mux_count * sizeof(mux_chunk_t));
+            dr_global_free(mux_index, mux_max * sizeof(mux_chunk_t));
+        }
+        mux_index = index;
+        mux_max = max;
+    }
+    mux_index[mux_count++] = chunk;
+    dr_mutex_unlock(mux_lock);
+
+    return mux_write_at(chunk.offset, &chunk, sizeof(chunk)) &&
+        mux_write_at(chunk.offset + sizeof(chunk), data, count);
+}
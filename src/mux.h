@@ -0,0 +1,16 @@
+#pragma once
+
+#include "dr_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool mux_init(const char *path);
+void mux_exit(void);
+bool mux_enabled(void);
+bool mux_write(uint serial, uint seq, const char *data, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,237 @@
+#include "dr_api.h"
+#include "rangetree.h"
+
+struct _range_node_t {
+    app_pc start;
+    app_pc end;
+    int height;
+    range_node_t *left;
+    range_node_t *right;
+};
+
+static int
+node_height(range_node_t *node)
+{
+    return node ? node->height : 0;
+}
+
+static void
+node_update(range_node_t *node)
+{
+    int hl = node_height(node->left);
+    int hr = node_height(node->right);
+    node->height = (hl > hr ? hl : hr) + 1;
+}
+
+static range_node_t *
+rotate_right(range_node_t *node)
+{
+    range_node_t *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+static range_node_t *
+rotate_left(range_node_t *node)
+{
+    range_node_t *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+static range_node_t *
+node_balance(range_node_t *node)
+{
+    int diff;
+
+    node_update(node);
+    diff = node_height(node->left) - node_height(node->right);
+
+    if (diff > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right))
+            node->left = rotate_left(node->left);
+        return rotate_right(node);
+    }
+    if (diff < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left))
+            node->right = rotate_right(node->right);
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static range_node_t *
+node_insert(range_node_t *node, range_node_t *item)
+{
+    if (!node) return item;
+
+    if (item->start < node->start)
+        node->left = node_insert(node->left, item);
+    else
+        node->right = node_insert(node->right, item);
+
+    return node_balance(node);
+}
+
+/* Detach the leftmost node of the subtree into *min */
+static range_node_t *
+node_remove_min(range_node_t *node, range_node_t **min)
+{
+    if (!node->left) {
+        *min = node;
+        return node->right;
+    }
+    node->left = node_remove_min(node->left, min);
+    return node_balance(node);
+}
+
+/* Unlink the node starting at start, the node itself is not freed */
+static range_node_t *
+node_remove(range_node_t *node, app_pc start)
+{
+    range_node_t *min;
+
+    if (!node) return NULL;
+
+    if (start < node->start) {
+        node->left = node_remove(node->left, start);
+    } else if (start > node->start) {
+        node->right = node_remove(node->right, start);
+    } else {
+        if (!node->right) return node->left;
+        node->right = node_remove_min(node->right, &min);
+        min->left = node->left;
+        min->right = node->right;
+        return node_balance(min);
+    }
+
+    return node_balance(node);
+}
+
+/* Node with the greatest start not above pc (or below pc if strict) */
+static range_node_t *
+node_floor(range_node_t *node, app_pc pc, bool strict)
+{
+    range_node_t *found = NULL;
+
+    while (node) {
+        if (node->start < pc || (!strict && node->start == pc)) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return found;
+}
+
+static void
+node_free_all(range_node_t *node)
+{
+    if (!node) return;
+    node_free_all(node->left);
+    node_free_all(node->right);
+    dr_global_free(node, sizeof(range_node_t));
+}
+
+static void
+tree_insert(rangetree_t *tree, app_pc start, app_pc end)
+{
+    range_node_t *item = dr_global_alloc(sizeof(range_node_t));
+
+    item->start = start;
+    item->end = end;
+    item->height = 1;
+    item->left = item->right = NULL;
+
+    tree->root = node_insert(tree->root, item);
+    tree->count++;
+}
+
+static void
+tree_erase(rangetree_t *tree, range_node_t *node)
+{
+    tree->root = node_remove(tree->root, node->start);
+    tree->count--;
+    dr_global_free(node, sizeof(range_node_t));
+}
+
+void
+rangetree_init(rangetree_t *tree)
+{
+    tree->root = NULL;
+    tree->count = 0;
+    tree->lock = dr_rwlock_create();
+}
+
+void
+rangetree_delete(rangetree_t *tree)
+{
+    node_free_all(tree->root);
+    tree->root = NULL;
+    tree->count = 0;
+    dr_rwlock_destroy(tree->lock);
+}
+
+void
+rangetree_add(rangetree_t *tree, app_pc start, app_pc end)
+{
+    range_node_t *node;
+
+    if (start >= end) return;
+
+    dr_rwlock_write_lock(tree->lock);
+
+    /* absorb every range overlapping or touching [start, end) */
+    while ((node = node_floor(tree->root, end, false)) != NULL && node->end >= start) {
+        if (node->start < start) start = node->start;
+        if (node->end > end) end = node->end;
+        tree_erase(tree, node);
+    }
+    tree_insert(tree, start, end);
+
+    dr_rwlock_write_unlock(tree->lock);
+}
+
+void
+rangetree_remove(rangetree_t *tree, app_pc start, app_pc end)
+{
+    range_node_t *node;
+    app_pc node_start, node_end;
+
+    if (start >= end) return;
+
+    dr_rwlock_write_lock(tree->lock);
+
+    /* cut [start, end) out, keeping what sticks out on either side */
+    while ((node = node_floor(tree->root, end, true)) != NULL && node->end > start) {
+        node_start = node->start;
+        node_end = node->end;
+        tree_erase(tree, node);
+        if (node_start < start) tree_insert(tree, node_start, start);
+        if (node_end > end) tree_insert(tree, end, node_end);
+    }
+
+    dr_rwlock_write_unlock(tree->lock);
+}
+
+bool
+rangetree_contains(rangetree_t *tree, app_pc pc)
+{
+    range_node_t *node;
+    bool found;
+
+    dr_rwlock_read_lock(tree->lock);
+    node = node_floor(tree->root, pc, false);
+    found = node && pc < node->end;
+    dr_rwlock_read_unlock(tree->lock);
+
+    return found;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "dr_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set of disjoint [start, end) address ranges kept in an AVL tree,
+ * overlapping or adjacent ranges are merged when added.
+ */
+typedef struct _range_node_t range_node_t;
+
+typedef struct _rangetree_t {
+    range_node_t *root;
+    uint count;
+    void *lock;
+} rangetree_t;
+
+void rangetree_init(rangetree_t *tree);
+void rangetree_delete(rangetree_t *tree);
+void rangetree_add(rangetree_t *tree, app_pc start, app_pc end);
+void rangetree_remove(rangetree_t *tree, app_pc start, app_pc end);
+bool rangetree_contains(rangetree_t *tree, app_pc pc);
+
+#ifdef __cplusplus
+}
+#endif
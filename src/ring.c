@@ -0,0 +1,129 @@
+#include "dr_api.h"
+#include <intrin.h>
+#include <windows.h>
+#include "datatypes.h"
+#include "ring.h"
+
+#pragma intrinsic(_InterlockedExchange)
+
+/* Live output: filled trace buffers are copied into a ring in a named
+ * file mapping instead of the dump files, parselog consumes it while the
+ * application runs. Each buffer goes in as a chunk tagged with its thread.
+ */
+
+static HANDLE ring_mapping = NULL;
+static ring_header_t *ring = NULL;
+static char *ring_data = NULL;
+static ring_full_t ring_policy = RING_FULL_BLOCK;
+static void *ring_lock = NULL;
+
+bool
+ring_init(const char *name, size_t size, ring_full_t policy)
+{
+    size_t pow2 = 1;
+
+    if (ring) return true;
+
+    while (pow2 < size) pow2 <<= 1;
+
+    ring_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        0, (DWORD)(sizeof(ring_header_t) + pow2), name);
+    if (ring_mapping == NULL) return false;
+
+    ring = MapViewOfFile(ring_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (ring == NULL) {
+        CloseHandle(ring_mapping);
+        ring_mapping = NULL;
+        return false;
+    }
+
+    memset(ring, 0, sizeof(ring_header_t));
+    ring->size = (uint)pow2;
+    ring->magic = RING_MAGIC;
+    ring_data = (char*)(ring + 1);
+    ring_policy = policy;
+    ring_lock = dr_mutex_create();
+
+    return true;
+}
+
+void
+ring_exit(void)
+{
+    if (!ring) return;
+
+    if (ring->dropped || ring->spilled)
+        dr_printf("Ring full: %u buffers dropped, %u spilled\n", ring->dropped, ring->spilled);
+    _InterlockedExchange((volatile long*)&ring->closed, 1);
+    dr_mutex_destroy(ring_lock);
+    ring_lock = NULL;
+
+    UnmapViewOfFile(ring);
+    ring = NULL;
+    /* the consumer keeps the mapping alive with its own handle */
+    CloseHandle(ring_mapping);
+    ring_mapping = NULL;
+}
+
+bool
+ring_enabled(void)
+{
+    return ring != NULL;
+}
+
+/* Copy into the data area from offset pos, wrapping around its end */
+static void
+ring_copy(uint pos, const void *src, size_t count)
+{
+    uint off = pos & (ring->size - 1);
+    size_t first = ring->size - off;
+
+    if (first > count) first = count;
+    memcpy(ring_data + off, src, first);
+    if (count > first)
+        memcpy(ring_data, (const char*)src + first, count - first);
+}
+
+/* Publish a buffer of the thread, a count of 0 tells the thread exited.
+ * Returns false when the ring is full and the policy spills, the caller
+ * then writes the buffer to its dump file.
+ */
+bool
+ring_write(uint thread_id, const char *data, size_t count)
+{
+    ring_chunk_t chunk;
+    uint need = (uint)(sizeof(ring_chunk_t) + ((count + RING_ALIGN - 1) & ~(RING_ALIGN - 1)));
+    uint head;
+
+    chunk.thread_id = thread_id;
+    chunk.count = (uint)count;
+
+    dr_mutex_lock(ring_lock);
+
+    while (need > ring->size - (ring->head - ring->tail)) {
+        if (ring_policy == RING_FULL_BLOCK && need <= ring->size) {
+            dr_mutex_unlock(ring_lock);
+            dr_sleep(1);
+            dr_mutex_lock(ring_lock);
+            continue;
+        }
+        if (ring_policy == RING_FULL_SPILL) {
+            ring->spilled++;
+            dr_mutex_unlock(ring_lock);
+            return false;
+        }
+        ring->dropped++;
+        dr_mutex_unlock(ring_lock);
+        return true;
+    }
+
+    head = ring->head;
+    ring_copy(head, &chunk, sizeof(chunk));
+    ring_copy(head + sizeof(chunk), data, count);
+    /* publish only once the chunk is complete */
+    _InterlockedExchange((volatile long*)&ring->head, head + need);
+
+    dr_mutex_unlock(ring_lock);
+
+    return true;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "dr_api.h"
+#include "bbtrace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool ring_init(const char *name, size_t size, ring_full_t policy);
+void ring_exit(void);
+bool ring_enabled(void);
+bool ring_write(uint thread_id, const char *data, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
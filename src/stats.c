@@ -0,0 +1,175 @@
+#include "dr_api.h"
+#include <string.h>
+#include "stats.h"
+
+/* Overhead counters: every thread counts in its own tracer_stats_t, one
+ * line per thread goes to the info file as it exits and the totals at
+ * exit. With an interval a client thread also writes the running totals,
+ * the threads still alive included, every that many seconds.
+ */
+
+#define U64 UINT64_FORMAT_STRING
+
+static file_t info_file = INVALID_FILE;
+static void *stats_lock = NULL;
+/* exited threads summed up, running ones linked */
+static tracer_stats_t totals;
+static uint num_threads = 0;
+static tracer_stats_t *live = NULL;
+static uint interval_ms = 0;
+static uint64 start_ms = 0;
+static void *stopped_event = NULL;
+static volatile bool stats_stop = false;
+
+static void
+stats_add(tracer_stats_t *sum, const tracer_stats_t *stats)
+{
+    sum->blocks += stats->blocks;
+    sum->traced += stats->traced;
+    sum->build_ticks += stats->build_ticks;
+    sum->mem_refs += stats->mem_refs;
+    sum->flushes += stats->flushes;
+    sum->bytes += stats->bytes;
+    sum->write_ticks += stats->write_ticks;
+    sum->lib_calls += stats->lib_calls;
+}
+
+/* One write per line, the other threads write to the info file as well */
+static void
+stats_write(const char *prefix, const tracer_stats_t *stats)
+{
+    char line[512];
+    int len;
+
+    len = dr_snprintf(line, sizeof(line), "%s,blocks:"U64",traced:"U64",build_ticks:"U64
+        ",mem_refs:"U64",flushes:"U64",bytes:"U64",write_ticks:"U64",lib_calls:"U64"\n",
+        prefix, stats->blocks, stats->traced, stats->build_ticks, stats->mem_refs,
+        stats->flushes, stats->bytes, stats->write_ticks, stats->lib_calls);
+    if (len < 0) {
+        /* cut short, still a whole line */
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    dr_write_file(info_file, line, len);
+}
+
+/* Running totals, read while the threads keep counting: only a hint */
+static void
+stats_write_live(void)
+{
+    char prefix[64];
+    tracer_stats_t sum;
+    tracer_stats_t *stats;
+    uint threads = 0;
+
+    /* never waits, a thread exiting holds the lock a moment only */
+    if (!dr_mutex_trylock(stats_lock)) return;
+    sum = totals;
+    for (stats = live; stats; stats = stats->next) {
+        stats_add(&sum, stats);
+        threads++;
+    }
+    dr_mutex_unlock(stats_lock);
+
+    dr_snprintf(prefix, sizeof(prefix), "stats:live,ms:"U64",threads:%u",
+        dr_get_milliseconds() - start_ms, threads);
+    stats_write(prefix, &sum);
+}
+
+static void
+stats_thread(void *arg)
+{
+    uint64 next = start_ms + interval_ms;
+
+    /* keeps going while DR synchronizes with the app threads at exit */
+    dr_client_thread_set_suspendable(false);
+
+    while (!stats_stop) {
+        dr_sleep(100);
+        if (dr_get_milliseconds() < next) continue;
+        next += interval_ms;
+        stats_write_live();
+    }
+
+    dr_event_signal(stopped_event);
+}
+
+/* Counters go to f, and every interval seconds the running totals, 0 only
+ * writes them at exit */
+void
+stats_init(file_t f, uint interval)
+{
+    if (stats_lock) return;
+
+    info_file = f;
+    stats_lock = dr_mutex_create();
+    memset(&totals, 0, sizeof(totals));
+    start_ms = dr_get_milliseconds();
+
+    if (interval) {
+        interval_ms = interval * 1000;
+        stopped_event = dr_event_create();
+        if (!dr_create_client_thread(stats_thread, NULL)) {
+            dr_printf("WARNING: Unable to create stats thread\n");
+            dr_event_destroy(stopped_event);
+            stopped_event = NULL;
+        }
+    }
+}
+
+void
+stats_exit(void)
+{
+    char prefix[64];
+
+    if (!stats_lock) return;
+
+    if (stopped_event) {
+        stats_stop = true;
+        dr_event_wait(stopped_event);
+        dr_event_destroy(stopped_event);
+        stopped_event = NULL;
+    }
+
+    /* threads DR did not see exit are still linked */
+    for (; live; live = live->next) {
+        stats_add(&totals, live);
+        num_threads++;
+    }
+    dr_snprintf(prefix, sizeof(prefix), "stats:total,ms:"U64",threads:%u",
+        dr_get_milliseconds() - start_ms, num_threads);
+    stats_write(prefix, &totals);
+
+    dr_mutex_destroy(stats_lock);
+    stats_lock = NULL;
+}
+
+void
+stats_thread_init(tracer_stats_t *stats)
+{
+    memset(stats, 0, sizeof(tracer_stats_t));
+
+    dr_mutex_lock(stats_lock);
+    stats->next = live;
+    if (live) live->prev = stats;
+    live = stats;
+    dr_mutex_unlock(stats_lock);
+}
+
+/* Writes the line of the thread and moves its counts to the totals */
+void
+stats_thread_exit(thread_id_t thread_id, tracer_stats_t *stats)
+{
+    char prefix[32];
+
+    dr_mutex_lock(stats_lock);
+    if (stats->prev) stats->prev->next = stats->next;
+    else live = stats->next;
+    if (stats->next) stats->next->prev = stats->prev;
+    stats_add(&totals, stats);
+    num_threads++;
+    dr_mutex_unlock(stats_lock);
+
+    dr_snprintf(prefix, sizeof(prefix), "tid:%d", thread_id);
+    stats_write(prefix, stats);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "dr_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* What the tracer itself costs, counted by each thread in its own copy.
+ * Ticks are of the time stamp counter, as the time records of the trace.
+ */
+typedef struct _tracer_stats_t {
+    /* blocks built, and of them the ones instrumented for the trace */
+    uint64 blocks;
+    uint64 traced;
+    uint64 build_ticks;
+    /* memory refs instrumented */
+    uint64 mem_refs;
+    /* buffers handed to the output, their bytes and the ticks writing them
+     * took, in the writer thread for the buffers handed to it */
+    uint64 flushes;
+    uint64 bytes;
+    uint64 write_ticks;
+    /* wrapped calls recorded */
+    uint64 lib_calls;
+    /* linked while the thread runs, the periodic dump walks them */
+    struct _tracer_stats_t *prev;
+    struct _tracer_stats_t *next;
+} tracer_stats_t;
+
+void stats_init(file_t f, uint interval);
+void stats_exit(void);
+void stats_thread_init(tracer_stats_t *stats);
+void stats_thread_exit(thread_id_t thread_id, tracer_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,69 +1,156 @@
 #include "synchro.h"
+#include <intrin.h>
 #include "hashtable.h"
 #include "datatypes.h"
 
-static hashtable_t cs_table;
-static hashtable_t hmutex_table;
-static hashtable_t hevent_table;
-static void* hevent_lock;
+#pragma intrinsic(_InterlockedCompareExchange)
+#pragma intrinsic(_InterlockedIncrement)
+
+/* Sequence counters for sync objects, keyed by CS address or handle.
+ * Every wrapped sync call bumps its counter, so the tables are hit from
+ * all application threads at once: open addressing with the key claimed
+ * by a compare-exchange and the count bumped by an atomic increment,
+ * no lock on the way. Slots are never released (handles get reused),
+ * once a table is full the remaining keys go to a locked hashtable.
+ */
+
+#define SYNCHRO_TABLE_BITS 14
+#define SYNCHRO_TABLE_SIZE (1 << SYNCHRO_TABLE_BITS)
+
+typedef struct _sync_slot_t {
+    volatile long key;
+    volatile long count;
+} sync_slot_t;
+
+typedef struct _sync_table_t {
+    sync_slot_t *slots;
+    hashtable_t overflow;
+    void *overflow_lock;
+} sync_table_t;
+
+static sync_table_t cs_table;
+static sync_table_t hmutex_table;
+static sync_table_t hevent_table;
+
+static void
+sync_table_init(sync_table_t *table)
+{
+    table->slots = dr_global_alloc(SYNCHRO_TABLE_SIZE * sizeof(sync_slot_t));
+    memset(table->slots, 0, SYNCHRO_TABLE_SIZE * sizeof(sync_slot_t));
+    hashtable_init(&table->overflow, 6, HASH_INTPTR, false);
+    table->overflow_lock = dr_mutex_create();
+}
+
+static void
+sync_table_delete(sync_table_t *table)
+{
+    dr_mutex_destroy(table->overflow_lock);
+    hashtable_delete(&table->overflow);
+    dr_global_free(table->slots, SYNCHRO_TABLE_SIZE * sizeof(sync_slot_t));
+    table->slots = NULL;
+}
+
+static uint
+sync_hash(void *key)
+{
+    /* handles are multiples of 4, CS are at least dword aligned */
+    return (((uint)key >> 2) * 2654435761u) >> (32 - SYNCHRO_TABLE_BITS);
+}
+
+/* Slot holding key, claimed for it when create is set, NULL when the key
+ * is absent or the table is full
+ */
+static sync_slot_t *
+sync_table_slot(sync_table_t *table, void *key, bool create)
+{
+    uint i, pos = sync_hash(key);
+    long seen;
+
+    for (i = 0; i < SYNCHRO_TABLE_SIZE; i++) {
+        sync_slot_t *slot = &table->slots[pos];
+        seen = slot->key;
+        if (seen == (long)key) return slot;
+        if (seen == 0) {
+            if (!create) return NULL;
+            seen = _InterlockedCompareExchange(&slot->key, (long)key, 0);
+            if (seen == 0 || seen == (long)key) return slot;
+        }
+        pos = (pos + 1) & (SYNCHRO_TABLE_SIZE - 1);
+    }
+
+    return NULL;
+}
+
+static uint
+sync_table_inc(sync_table_t *table, void *key)
+{
+    sync_slot_t *slot = NULL;
+    uint count;
+
+    /* a zero key marks an empty slot */
+    if (key) slot = sync_table_slot(table, key, true);
+    if (slot) return (uint)_InterlockedIncrement(&slot->count);
+
+    dr_mutex_lock(table->overflow_lock);
+    count = (uint)hashtable_lookup(&table->overflow, key);
+    hashtable_add_replace(&table->overflow, key, (void*) ++count);
+    dr_mutex_unlock(table->overflow_lock);
+
+    return count;
+}
+
+static uint
+sync_table_get(sync_table_t *table, void *key)
+{
+    sync_slot_t *slot = NULL;
+    uint count;
+
+    if (key) slot = sync_table_slot(table, key, false);
+    if (slot) return (uint)slot->count;
+
+    dr_mutex_lock(table->overflow_lock);
+    count = (uint)hashtable_lookup(&table->overflow, key);
+    dr_mutex_unlock(table->overflow_lock);
+
+    return count;
+}
 
 void
 synchro_init(void)
 {
-    hashtable_init(&cs_table, 6, HASH_INTPTR, false);
-    hashtable_init(&hmutex_table, 6, HASH_INTPTR, false);
-    hashtable_init(&hevent_table, 6, HASH_INTPTR, false);
-    hevent_lock = dr_mutex_create();
+    sync_table_init(&cs_table);
+    sync_table_init(&hmutex_table);
+    sync_table_init(&hevent_table);
 }
 
 void
 synchro_exit(void)
 {
-    dr_mutex_destroy(hevent_lock);
-    hashtable_delete(&hevent_table);
-    hashtable_delete(&hmutex_table);
-    hashtable_delete(&cs_table);
+    sync_table_delete(&hevent_table);
+    sync_table_delete(&hmutex_table);
+    sync_table_delete(&cs_table);
 }
 
 uint
 synchro_inc_cs(void *cs)
 {
-    uint count = (uint)hashtable_lookup(&cs_table, cs);
-    hashtable_add_replace(&cs_table, cs, (void*) ++count);
-    return count;
+    return sync_table_inc(&cs_table, cs);
 }
 
 uint
 synchro_inc_hmutex(void *hmutex, uint kind)
 {
-    void *lock = 0;
-
-    hashtable_t *table = &hmutex_table;
-
-    if (kind == SYNC_EVENT) {
-        table = &hevent_table;
-        lock = hevent_lock;
-    }
-
-    if (lock) dr_mutex_lock(lock);
+    sync_table_t *table = &hmutex_table;
 
-    uint count = (uint)hashtable_lookup(table, hmutex);
-    hashtable_add_replace(table, hmutex, (void*) ++count);
+    if (kind == SYNC_EVENT) table = &hevent_table;
 
-    if (lock) dr_mutex_unlock(lock);
-
-    return count;
+    return sync_table_inc(table, hmutex);
 }
 
 uint
 synchro_kind_hmutex(void *hmutex)
 {
-    uint count;
-    count = (uint)hashtable_lookup(&hmutex_table, hmutex);
-    if (count) return SYNC_MUTEX;
-
-    count = (uint)hashtable_lookup(&hevent_table, hmutex);
-    if (count) return SYNC_EVENT;
-
+    if (sync_table_get(&hmutex_table, hmutex)) return SYNC_MUTEX;
+    if (sync_table_get(&hevent_table, hmutex)) return SYNC_EVENT;
     return 0;
 }
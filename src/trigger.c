@@ -0,0 +1,200 @@
+#include "dr_api.h"
+#include <intrin.h>
+#include <string.h>
+#include "drreg.h"
+#include "drwrap.h"
+#include "trigger.h"
+
+#pragma intrinsic(_InterlockedCompareExchange)
+#pragma intrinsic(_InterlockedIncrement)
+
+/* Delayed start: until a trigger fires the blocks are built without the
+ * trace instrumentation, only the trigger checks go in. Firing flushes
+ * the code cache so every block is built again with it, stopping does
+ * the same the other way. A pause nudge goes the same way and back.
+ */
+
+enum {
+    TRIGGER_WAITING,
+    TRIGGER_TRACING,
+    TRIGGER_STOPPED,
+    TRIGGER_PAUSED
+};
+
+static const char *state_names[] = { "waiting", "started", "stopped", "paused" };
+
+static volatile long state = TRIGGER_TRACING;
+static app_pc start_pc = NULL;
+static app_pc stop_pc = NULL;
+static char start_module[MAXIMUM_PATH];
+static char start_name[MAXIMUM_PATH];
+static app_pc start_func = NULL;
+static uint start_calls = 0;
+static volatile long calls = 0;
+static volatile int countdown = 0;
+static bool counting = false;
+/* called before each switch into tracing */
+static void (*rearm_threads)(void) = NULL;
+
+static void
+trigger_fire(long from, long to)
+{
+    if (state != from) return;
+    /* the threads ran blocks built plain, set up before any is built again */
+    if (to == TRIGGER_TRACING && rearm_threads)
+        rearm_threads();
+    if (_InterlockedCompareExchange(&state, to, from) != from) return;
+
+    dr_printf("Trigger: tracing %s\n", state_names[to]);
+    /* cannot flush right away from a clean call, done once threads leave the cache */
+    dr_delay_flush_region(NULL, ~(size_t)0, 0, NULL);
+}
+
+static void
+at_start(void)
+{
+    trigger_fire(TRIGGER_WAITING, TRIGGER_TRACING);
+}
+
+static void
+at_stop(void)
+{
+    trigger_fire(TRIGGER_TRACING, TRIGGER_STOPPED);
+}
+
+static void
+start_call_entry(void *wrapcxt, INOUT void **user_data)
+{
+    if ((uint)_InterlockedIncrement(&calls) >= start_calls)
+        trigger_fire(TRIGGER_WAITING, TRIGGER_TRACING);
+}
+
+void
+trigger_init(const trigger_options_t *options, const module_data_t *exe,
+             void (*rearm)(void))
+{
+    const char *sep;
+
+    rearm_threads = rearm;
+
+    if (options->start_offset)
+        start_pc = exe->start + options->start_offset;
+    if (options->stop_offset)
+        stop_pc = exe->start + options->stop_offset;
+
+    start_module[0] = start_name[0] = 0;
+    if (options->start_call && options->start_call[0]) {
+        sep = strchr(options->start_call, '!');
+        if (sep) {
+            dr_snprintf(start_module, sizeof(start_module), "%.*s",
+                (int)(sep - options->start_call), options->start_call);
+            dr_snprintf(start_name, sizeof(start_name), "%s", sep + 1);
+        } else {
+            dr_snprintf(start_name, sizeof(start_name), "%s", options->start_call);
+        }
+        start_calls = options->start_calls ? options->start_calls : 1;
+    }
+
+    if (options->start_blocks) {
+        countdown = (int)options->start_blocks;
+        counting = true;
+    }
+
+    if (start_pc || start_name[0] || counting)
+        state = TRIGGER_WAITING;
+}
+
+void
+trigger_exit(void)
+{
+    if (start_func) {
+        drwrap_unwrap(start_func, start_call_entry, NULL);
+        start_func = NULL;
+    }
+}
+
+bool
+trigger_tracing(void)
+{
+    return state == TRIGGER_TRACING;
+}
+
+/* Nudged pause and resume, only from and back to tracing */
+void
+trigger_pause(bool pause)
+{
+    if (pause)
+        trigger_fire(TRIGGER_TRACING, TRIGGER_PAUSED);
+    else
+        trigger_fire(TRIGGER_PAUSED, TRIGGER_TRACING);
+}
+
+void
+trigger_module_load(const module_data_t *mod)
+{
+    const char *name;
+    app_pc func;
+
+    if (!start_name[0] || start_func || state != TRIGGER_WAITING) return;
+
+    name = dr_module_preferred_name(mod);
+    if (start_module[0] && (!name || _stricmp(name, start_module) != 0)) return;
+
+    func = (app_pc)dr_get_proc_address(mod->handle, start_name);
+    if (func && drwrap_wrap(func, start_call_entry, NULL))
+        start_func = func;
+}
+
+void
+trigger_module_unload(const module_data_t *mod)
+{
+    if (start_func && start_func >= mod->start && start_func < mod->end) {
+        drwrap_unwrap(start_func, start_call_entry, NULL);
+        start_func = NULL;
+    }
+}
+
+/* Block countdown: lock sub [countdown], 1; jg skip; clean call at_start */
+static void
+insert_countdown(void *drcontext, instrlist_t *bb, instr_t *where)
+{
+    instr_t *skip = INSTR_CREATE_label(drcontext);
+    instr_t *instr;
+
+    if (drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+
+    instr = INSTR_CREATE_sub(drcontext,
+        OPND_CREATE_ABSMEM((void *)&countdown, OPSZ_4), OPND_CREATE_INT8(1));
+    instrlist_meta_preinsert(bb, where, LOCK(instr));
+    instr = INSTR_CREATE_jcc(drcontext, OP_jg, opnd_create_instr(skip));
+    instrlist_meta_preinsert(bb, where, instr);
+    dr_insert_clean_call(drcontext, bb, where, (void *)at_start, false, 0);
+    instrlist_meta_preinsert(bb, where, skip);
+
+    drreg_unreserve_aflags(drcontext, bb, where);
+}
+
+/* Checks going into every block while the triggers are armed, counted
+ * tells the block belongs to the traced code.
+ */
+void
+trigger_insert(void *drcontext, instrlist_t *bb, instr_t *instr, bool counted)
+{
+    app_pc pc;
+
+    if (state == TRIGGER_STOPPED || state == TRIGGER_PAUSED || !instr_is_app(instr)) return;
+
+    pc = instr_get_app_pc(instr);
+
+    if (state == TRIGGER_WAITING) {
+        if (start_pc && pc == start_pc)
+            dr_insert_clean_call(drcontext, bb, instr, (void *)at_start, false, 0);
+        if (counting && counted && instr == instrlist_first_app(bb))
+            insert_countdown(drcontext, bb, instr);
+    } else if (stop_pc && pc == stop_pc) {
+        dr_insert_clean_call(drcontext, bb, instr, (void *)at_stop, false, 0);
+    }
+}
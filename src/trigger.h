@@ -0,0 +1,34 @@
+#pragma once
+
+#include "dr_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* When recording starts and stops, all optional: with none set the trace
+ * starts at the first block as before.
+ */
+typedef struct _trigger_options_t {
+    /* exe offsets, 0 when unused */
+    uint start_offset;
+    uint stop_offset;
+    /* exported symbol, "module!name" or "name" for any module */
+    const char *start_call;
+    uint start_calls;
+    /* blocks of the traced code to run first */
+    uint start_blocks;
+} trigger_options_t;
+
+void trigger_init(const trigger_options_t *options, const module_data_t *exe,
+                  void (*rearm)(void));
+void trigger_exit(void);
+bool trigger_tracing(void);
+void trigger_pause(bool pause);
+void trigger_module_load(const module_data_t *mod);
+void trigger_module_unload(const module_data_t *mod);
+void trigger_insert(void *drcontext, instrlist_t *bb, instr_t *instr, bool counted);
+
+#ifdef __cplusplus
+}
+#endif
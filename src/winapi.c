@@ -2,6 +2,8 @@
 #include "datatypes.h"
 #include "drwrap.h"
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include "hashtable.h"
 #include <windows.h>
 #include <mmsystem.h>
@@ -43,6 +45,8 @@ static void after_WaitForSingleObject(void *wrapcxt, void *user_data);
 static void after_CloseHandle(void *wrapcxt, void *user_data);
 static void after_VirtualProtect(void *wrapcxt, void *user_data);
 static void after_VirtualAlloc(void *wrapcxt, void *user_data);
+static void before_VirtualFree(void *wrapcxt, void *user_data);
+static void after_VirtualFree(void *wrapcxt, void *user_data);
 static void after_RegisterClassEx(void *wrapcxt, void *user_data);
 
 static void *IDirect3D9_lpVtbl = 0;
@@ -65,7 +69,7 @@ static const winapi_info_t winapi_infos[] = {
     {KERNEL32_DLL, "SetFilePointer", 4, {A_HANDLE, A_DWORD, A_LPDWORD, A_DWORD}, A_DWORD, before_SetFilePointer, after_SetFilePointer},
     {KERNEL32_DLL, "VirtualProtect", 4, {A_LPVOID, A_DWORD, A_DWORD, A_LPDWORD}, A_BOOL, NULL, after_VirtualProtect},
     {KERNEL32_DLL, "VirtualAlloc", 4, {A_LPVOID, A_DWORD, A_DWORD, A_DWORD}, A_LPVOID, NULL, after_VirtualAlloc},
-    {KERNEL32_DLL, "VirtualFree", 3, {A_LPVOID, A_DWORD, A_DWORD}, A_BOOL},
+    {KERNEL32_DLL, "VirtualFree", 3, {A_LPVOID, A_DWORD, A_DWORD}, A_BOOL, before_VirtualFree, after_VirtualFree},
     {KERNEL32_DLL, "SetEvent", 1, {A_HANDLE}, A_BOOL, before_ResetEvent, NULL},
     {KERNEL32_DLL, "ResetEvent", 1, {A_HANDLE}, A_BOOL, before_ResetEvent, NULL},
     {KERNEL32_DLL, "CreateEventA", 4, {A_LPVOID, A_BOOL, A_BOOL, A_LPSTR}, A_HANDLE, NULL, after_CreateEvent},
@@ -330,6 +334,12 @@ static const winapi_info_t winapi_infos[] = {
 static hashtable_t sym_info_table;
 static hashtable_t winapi_info_table;
 
+/* -api_spec: entries compiled from the file, the text keeps their names */
+static winapi_info_t *spec_infos = NULL;
+static uint spec_size = 0;
+static char *spec_text = NULL;
+static size_t spec_text_size = 0;
+
 void winapi_init(void)
 {
     hashtable_init_ex(&sym_info_table, 6, HASH_INTPTR, false, false, sym_info_item_free, NULL, NULL);
@@ -346,6 +356,13 @@ winapi_exit(void)
 {
     hashtable_delete(&winapi_info_table);
     hashtable_delete(&sym_info_table);
+
+    if (spec_infos) {
+        dr_global_free(spec_infos, spec_size * sizeof(winapi_info_t));
+        dr_global_free(spec_text, spec_text_size);
+        spec_infos = NULL;
+        spec_text = NULL;
+    }
 }
 
 winapi_info_t *
@@ -354,9 +371,175 @@ winapi_get(const char *sym_name)
     return (winapi_info_t*)hashtable_lookup(&winapi_info_table, (void*)sym_name);
 }
 
+/* Entry of an export of shared_dll, spec entries may be tied to a module */
+winapi_info_t *
+winapi_lookup(const char *sym_name, uint shared_dll)
+{
+    winapi_info_t *winapi_info = winapi_get(sym_name);
+
+    if (winapi_info && spec_infos && winapi_info->shared_dll != NO_DLL &&
+        winapi_info->shared_dll != shared_dll)
+        return NULL;
+    return winapi_info;
+}
+
+/* Whether the hooks of the entry follow the code the app adds or removes,
+ * all coverage mode wraps */
+bool
+winapi_tracks_code(const winapi_info_t *info)
+{
+    return info && (info->post_hook == after_VirtualProtect ||
+        info->post_hook == after_VirtualAlloc || info->post_hook == after_VirtualFree);
+}
+
+/* Next blank separated token of *p, cut in place */
+static char *
+spec_token(char **p)
+{
+    char *token;
+
+    while (**p == ' ' || **p == '\t') (*p)++;
+    if (!**p) return NULL;
+
+    token = *p;
+    while (**p && **p != ' ' && **p != '\t') (*p)++;
+    if (**p) *(*p)++ = 0;
+    return token;
+}
+
+/* One line of the spec: [module!]name [args:N] [str:I,J,..] [noret]
+ * An API the table above hooks keeps its hooks, and the args and return
+ * record they need.
+ */
+static bool
+spec_compile(char *line, winapi_info_t *info)
+{
+    char *p = line;
+    char *token = spec_token(&p);
+    char *sep, *end;
+    const winapi_info_t *builtin;
+    uint strings = 0;
+    uint a;
+
+    if (!token || token[0] == '#') return false;
+
+    memset(info, 0, sizeof(winapi_info_t));
+    sep = strchr(token, '!');
+    if (sep) {
+        *sep = 0;
+        for (a = 1; a < sizeof(shared_dll_names)/sizeof(*shared_dll_names); a++) {
+            if (_stricmp(token, shared_dll_names[a]) == 0) info->shared_dll = a;
+        }
+        if (info->shared_dll == NO_DLL) {
+            dr_printf("WARNING: API spec: %s is not a traced module\n", token);
+            return false;
+        }
+        token = sep + 1;
+    }
+    info->sym_name = token;
+    info->tret = A_DWORD;
+
+    while ((token = spec_token(&p)) != NULL) {
+        if (strncmp(token, "args:", 5) == 0) {
+            info->nargs = strtoul(token + 5, NULL, 0);
+        } else if (strncmp(token, "str:", 4) == 0) {
+            for (sep = token + 4; ; sep = end + 1) {
+                a = strtoul(sep, &end, 0);
+                if (end == sep) break;
+                if (a < MAX_LIB_ARGS) strings |= 1 << a;
+                if (*end != ',') break;
+            }
+        } else if (strcmp(token, "noret") == 0) {
+            info->call_only = true;
+        } else {
+            dr_printf("WARNING: API spec: unknown '%s' for %s\n", token, info->sym_name);
+        }
+    }
+
+    /* string args are recorded too */
+    for (a = 0; a < MAX_LIB_ARGS; a++) {
+        if ((strings & (1 << a)) && info->nargs <= a) info->nargs = a + 1;
+    }
+
+    builtin = winapi_get(info->sym_name);
+    if (builtin) {
+        info->tret = builtin->tret;
+        info->pre_hook = builtin->pre_hook;
+        info->post_hook = builtin->post_hook;
+        if (info->pre_hook || info->post_hook) {
+            if (info->nargs < builtin->nargs) info->nargs = builtin->nargs;
+        }
+        if (info->post_hook) info->call_only = false;
+    }
+    if (info->nargs > MAX_LIB_ARGS) info->nargs = MAX_LIB_ARGS;
+
+    for (a = 0; a < info->nargs; a++)
+        info->targs[a] = (strings & (1 << a)) ? A_LPSTR : A_DWORD;
+
+    return true;
+}
+
+/* Replace the table above with the APIs of the spec file, returns how
+ * many; with none the table stays.
+ */
+uint
+winapi_load_spec(const char *path)
+{
+    file_t f = dr_open_file(path, DR_FILE_READ);
+    uint64 size;
+    char *line, *next, *p;
+    uint count = 0;
+
+    if (f == INVALID_FILE) return 0;
+    if (!dr_file_size(f, &size) || size == 0) {
+        dr_close_file(f);
+        return 0;
+    }
+
+    spec_text_size = (size_t)size + 1;
+    spec_text = dr_global_alloc(spec_text_size);
+    spec_text[dr_read_file(f, spec_text, (size_t)size)] = 0;
+    dr_close_file(f);
+
+    spec_size = 1;
+    for (p = spec_text; *p; p++) {
+        if (*p == '\n') spec_size++;
+    }
+    spec_infos = dr_global_alloc(spec_size * sizeof(winapi_info_t));
+
+    for (line = spec_text; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = 0;
+        p = strchr(line, '\r');
+        if (p) *p = 0;
+        if (spec_compile(line, &spec_infos[count])) count++;
+    }
+
+    if (!count) {
+        dr_global_free(spec_infos, spec_size * sizeof(winapi_info_t));
+        dr_global_free(spec_text, spec_text_size);
+        spec_infos = NULL;
+        spec_text = NULL;
+        return 0;
+    }
+
+    hashtable_clear(&winapi_info_table);
+    for (uint i = 0; i < count; i++) {
+        hashtable_add(&winapi_info_table,
+            (void*)spec_infos[i].sym_name, (void*)&spec_infos[i]);
+    }
+
+    return count;
+}
+
 static void
 sym_info_item_free(void *entry)
 {
+    sym_info_item_t *sym_info = entry;
+
+    /* at module unload or at exit, the module is still there for the name */
+    if (sym_info->calls)
+        dr_fprintf(get_info_file(), "api:%s,calls:%u\n", sym_info->sym.name, (uint)sym_info->calls);
     dr_global_free(entry, sizeof(sym_info_item_t));
 }
 
@@ -375,12 +558,17 @@ add_symbol_com(app_pc func, uint shared_dll, const char *sym_name, wrap_lib_user
     sym_info->sym.addr = func;
     sym_info->sym.ordinal = 0;
     sym_info->shared_dll = shared_dll;
-    sym_info->winapi_info = winapi_get(sym_name);
+    sym_info->winapi_info = winapi_lookup(sym_name, shared_dll);
+    sym_info->calls = 0;
 
     syminfo_add(func, sym_info);
 
-    drwrap_wrap_ex(func, lib_entry, lib_exit,
-        0, DRWRAP_UNWIND_ON_EXCEPTION | DRWRAP_CALLCONV_STDCALL);
+    /* with a spec only the methods it lists */
+    if (spec_infos && !sym_info->winapi_info) return;
+
+    drwrap_wrap_ex(func, lib_entry,
+        sym_info->winapi_info && sym_info->winapi_info->call_only ? NULL : lib_exit,
+        sym_info, DRWRAP_UNWIND_ON_EXCEPTION | DRWRAP_CALLCONV_STDCALL);
 }
 
 #define ADD_SYMBOL(SHARED_DLL, P, IFACE_NAME, FUNC_NAME) \
@@ -1061,10 +1249,11 @@ static void
 after_VirtualAlloc(void *wrapcxt, void *user_data)
 {
   wrap_lib_user_t *p_data = user_data;
-  char *ptr = (char*)p_data->args[0];
+  // the system picks the address when lpAddress is NULL
+  char *ptr = (char*)p_data->retval;
   uint size = (uint) p_data->args[1];
   uint protect = (uint) p_data->args[3];
-  if (protect & 0xF0) { // PAGE_EXECUTE_XXX
+  if (ptr && (protect & 0xF0)) { // PAGE_EXECUTE_XXX
     add_dynamic_codes(ptr, ptr + size);
 
     dr_printf("VirtualAlloc: %X %X %X\n",
@@ -1076,6 +1265,42 @@ after_VirtualAlloc(void *wrapcxt, void *user_data)
   }
 }
 
+static void
+before_VirtualFree(void *wrapcxt, void *user_data)
+{
+  wrap_lib_user_t *p_data = user_data;
+  char *ptr = (char*)p_data->args[0];
+  uint free_type = (uint) p_data->args[2];
+  MEMORY_BASIC_INFORMATION mbi;
+  uint size = 0;
+
+  if (!(free_type & MEM_RELEASE)) return;
+
+  // MEM_RELEASE passes no size, measure the allocation while it still exists
+  while (dr_virtual_query((byte*)ptr + size, &mbi, sizeof(mbi)) == sizeof(mbi) &&
+      mbi.AllocationBase == ptr && mbi.RegionSize) {
+    size += (uint) mbi.RegionSize;
+  }
+  p_data->args[1] = (void*) size;
+}
+
+static void
+after_VirtualFree(void *wrapcxt, void *user_data)
+{
+  wrap_lib_user_t *p_data = user_data;
+  char *ptr = (char*)p_data->args[0];
+  uint size = (uint) p_data->args[1];
+
+  if (!p_data->retval || !size) return;
+
+  remove_dynamic_codes(ptr, ptr + size);
+
+  if (get_info_file() != INVALID_FILE) {
+    dr_fprintf(get_info_file(), "virtualfree:0x%X,size:0x%X,type:0x%X\n",
+        (uint) ptr, size, (uint) p_data->args[2]);
+  }
+}
+
 static void
 after_ReadFile(void *wrapcxt, void *user_data)
 {
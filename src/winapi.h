@@ -50,12 +50,16 @@ typedef struct _winapi_info_t {
     uint tret;
     void (*pre_hook)(void *wrapcxt, void *user_data);
     void (*post_hook)(void *wrapcxt, void *user_data);
+    /* no return record, the call is written as returning at once */
+    bool call_only;
 } winapi_info_t;
 
 typedef struct _sym_info_item_t {
   dr_symbol_export_t sym;
   uint shared_dll;
   winapi_info_t *winapi_info;
+  /* recorded calls, written to the info file once the symbol goes */
+  volatile long calls;
 } sym_info_item_t;
 
 typedef struct _wrap_lib_user_t {
@@ -74,6 +78,9 @@ extern "C" {
 void winapi_init(void);
 void winapi_exit(void);
 winapi_info_t *winapi_get(const char *sym_name);
+winapi_info_t *winapi_lookup(const char *sym_name, uint shared_dll);
+bool winapi_tracks_code(const winapi_info_t *info);
+uint winapi_load_spec(const char *path);
 bool syminfo_add(app_pc func, sym_info_item_t *sym_info);
 bool syminfo_remove(app_pc func);
 sym_info_item_t* syminfo_get(app_pc func);
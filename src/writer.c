@@ -0,0 +1,140 @@
+#include "dr_api.h"
+#include <intrin.h>
+#include "writer.h"
+
+#pragma intrinsic(__rdtsc)
+#pragma intrinsic(_InterlockedExchange)
+
+/* Background writer: application threads hand over their filled buffers
+ * and keep running on a spare one, the writer thread performs the actual
+ * dr_write_file.
+ */
+
+#define WRITER_QUEUE_SIZE 256
+
+typedef struct {
+    file_t f;
+    char *data;
+    size_t count;
+    volatile long *busy;
+    uint64 *ticks;
+} writer_job_t;
+
+static writer_job_t queue[WRITER_QUEUE_SIZE];
+static uint queue_head = 0;
+static uint queue_tail = 0;
+static void *queue_lock = NULL;
+static void *queue_event = NULL;
+static void *stopped_event = NULL;
+static volatile bool writer_stop = false;
+
+static bool
+writer_pop(writer_job_t *job)
+{
+    bool found = false;
+
+    dr_mutex_lock(queue_lock);
+    if (queue_tail != queue_head) {
+        *job = queue[queue_tail % WRITER_QUEUE_SIZE];
+        queue_tail++;
+        found = true;
+    }
+    dr_mutex_unlock(queue_lock);
+
+    return found;
+}
+
+static void
+writer_thread(void *arg)
+{
+    writer_job_t job;
+    uint64 ts;
+
+    /* must keep draining while DR synchronizes with the app threads at exit */
+    dr_client_thread_set_suspendable(false);
+
+    for (;;) {
+        dr_event_wait(queue_event);
+        dr_event_reset(queue_event);
+
+        while (writer_pop(&job)) {
+            ts = __rdtsc();
+            dr_write_file(job.f, job.data, job.count);
+            *job.ticks += __rdtsc() - ts;
+            _InterlockedExchange(job.busy, 0);
+        }
+
+        if (writer_stop) break;
+    }
+
+    dr_event_signal(stopped_event);
+}
+
+void
+writer_init(void)
+{
+    if (queue_lock) return;
+
+    queue_lock = dr_mutex_create();
+    queue_event = dr_event_create();
+    stopped_event = dr_event_create();
+
+    if (!dr_create_client_thread(writer_thread, NULL)) {
+        DR_ASSERT_MSG(false, "Unable to create writer thread");
+    }
+}
+
+void
+writer_exit(void)
+{
+    if (!queue_lock) return;
+
+    writer_stop = true;
+    dr_event_signal(queue_event);
+    dr_event_wait(stopped_event);
+
+    dr_event_destroy(stopped_event);
+    dr_event_destroy(queue_event);
+    dr_mutex_destroy(queue_lock);
+    queue_lock = NULL;
+}
+
+/* Queue data for writing, *busy is set until the writer is done with it.
+ * The ticks the write takes are added to *ticks before *busy is cleared.
+ */
+void
+writer_submit(file_t f, char *data, size_t count, volatile long *busy,
+    uint64 *ticks)
+{
+    _InterlockedExchange(busy, 1);
+
+    dr_mutex_lock(queue_lock);
+    while (queue_head - queue_tail >= WRITER_QUEUE_SIZE) {
+        dr_mutex_unlock(queue_lock);
+        dr_thread_yield();
+        dr_mutex_lock(queue_lock);
+    }
+    queue[queue_head % WRITER_QUEUE_SIZE].f = f;
+    queue[queue_head % WRITER_QUEUE_SIZE].data = data;
+    queue[queue_head % WRITER_QUEUE_SIZE].count = count;
+    queue[queue_head % WRITER_QUEUE_SIZE].busy = busy;
+    queue[queue_head % WRITER_QUEUE_SIZE].ticks = ticks;
+    queue_head++;
+    dr_mutex_unlock(queue_lock);
+
+    dr_event_signal(queue_event);
+}
+
+/* Wait until the writer has released the buffer, returns true if we stalled */
+bool
+writer_wait(volatile long *busy)
+{
+    bool stalled = false;
+
+    while (*busy) {
+        stalled = true;
+        dr_thread_yield();
+    }
+
+    return stalled;
+}
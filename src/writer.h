@@ -0,0 +1,20 @@
+#pragma once
+
+#include "dr_api.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of buffers a thread may rotate through */
+#define MAX_WRITER_BUFFERS 8
+
+void writer_init(void);
+void writer_exit(void);
+void writer_submit(file_t f, char *data, size_t count, volatile long *busy,
+    uint64 *ticks);
+bool writer_wait(volatile long *busy);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,61 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Hammers a few shared critical sections from 1..32 threads, run it
+// under the tracer to see how the sync counters scale:
+// drrun.exe -c bbtrace.dll -- bench_synchro.exe [iterations]
+
+#define BENCH_LOCKS 8
+#define BENCH_MAX_THREADS 32
+
+static CRITICAL_SECTION locks[BENCH_LOCKS];
+static volatile LONG shared[BENCH_LOCKS];
+static int iterations = 20000;
+
+static DWORD WINAPI worker(LPVOID param)
+{
+	int first = (int)(INT_PTR)param;
+
+	for (int i = 0; i < iterations; i++) {
+		int n = (first + i) % BENCH_LOCKS;
+		EnterCriticalSection(&locks[n]);
+		shared[n]++;
+		LeaveCriticalSection(&locks[n]);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	HANDLE threads[BENCH_MAX_THREADS];
+	LARGE_INTEGER freq, start, stop;
+
+	if (argc > 1) iterations = atoi(argv[1]);
+
+	for (int n = 0; n < BENCH_LOCKS; n++)
+		InitializeCriticalSection(&locks[n]);
+
+	QueryPerformanceFrequency(&freq);
+
+	for (int count = 1; count <= BENCH_MAX_THREADS; count *= 2) {
+		QueryPerformanceCounter(&start);
+		for (int t = 0; t < count; t++)
+			threads[t] = CreateThread(NULL, 0, worker, (LPVOID)(INT_PTR)t, 0, NULL);
+		WaitForMultipleObjects(count, threads, TRUE, INFINITE);
+		QueryPerformanceCounter(&stop);
+
+		for (int t = 0; t < count; t++)
+			CloseHandle(threads[t]);
+
+		double secs = (double)(stop.QuadPart - start.QuadPart) / freq.QuadPart;
+		double ops = (double)count * iterations;
+		fprintf(stdout, "threads: %2d  ops: %10.0f  time: %8.3fs  ops/s: %12.0f\n",
+			count, ops, secs, ops / secs);
+	}
+
+	for (int n = 0; n < BENCH_LOCKS; n++)
+		DeleteCriticalSection(&locks[n]);
+
+	return 0;
+}